@@ -1,450 +1,544 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "heap.h"
 #include "FreeList.h"
+#include "Stats.h"
+#include "Tune.h"
 
 // Pointer to the head of the free list. Initialized to NULL, indicating that the free list is currently empty.
 FreeListNode *FreeListHead = NULL;
 
+// Size-class bins of the process heap, and the bins currently in use (swapped for a mapped heap)
+FreeBinIndex processBinIndex;
+FreeBinIndex *freeBinIndex = &processBinIndex;
+
+// Current end of the heap, maintained by heap.c
+extern char *programBreak;
+
+// Where the next compaction step resumes, maintained by Handle.c
+extern FreeListNode *compactResume;
+
+// Table of free address ranges known to hold only zero bytes (fresh sbrk memory, released pages)
+ZeroRange zeroRanges[ZERO_RANGE_MAX];
+uint32_t zeroRangeCount = 0;
+
 /**
- * @brief Calculates the number of times the program break can be decreased based on the remaining free memory.
+ * @brief Calculates how far the program break can be lowered based on the free memory at the top of the heap.
  *
- * This function iterates through the free list and calculates the total free size of contiguous memory blocks.
- * If the total free size exceeds 128 KB, the function determines how many times the program break (memory allocated to the heap)
- * can be reduced by 128 KB chunks. It also removes these blocks from the free list and adjusts the remaining free memory
- * accordingly.
+ * Free blocks are coalesced when they are inserted, so the only candidate is the free block at the top of the
+ * heap, freeBinIndex->tail. If it ends at the program break and is larger than tuneConfig.trimSize (128 KB by default), the break can be
+ * lowered by whole chunks of that size, keeping at least part of a chunk. The new break is rounded up to a page
+ * boundary, so a partial page with old data is never given back and later reported as zero, and whatever stays
+ * below it is large enough to remain a free block. The process heap is not trimmed below its reserve.
  *
- * @return uint8_t The number of times the program break can be decreased.
+ * @return uint64_t The number of bytes the program break can be lowered by, 0 if it should stay.
  */
-uint8_t calculate_decreases_in_program_break()
+uint64_t calculate_decreases_in_program_break()
 {
-    uint32_t decrease_count = 0;          // Tracks the number of 128 KB chunks that can be freed
-    uint32_t contiguous_block_count = 0;  // Counts contiguous blocks found in the free list
-    uint64_t total_free_size = 0;        // Accumulates the total size of contiguous free blocks
-    FreeListNode *contiguous_blocks[10000] = {0};  // Array to store pointers to contiguous blocks
-    FreeListNode *current_node = FreeListHead;     // Start at the head of the free list
-
-    // Iterate through the free list to find contiguous memory blocks
-    while (current_node != NULL)
+    FreeListNode *last_node = freeBinIndex->tail;   // Highest free block
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    char *lowest_break = NULL;                      // Lowest address the break may move to
+    char *new_break = NULL;                         // Break after trimming whole chunks
+    uint64_t chunk_count = 0;                       // Number of trim chunks that can be freed
+
+    // Only a free block that reaches the program break can be released
+    if (last_node == NULL || (char *)last_node + sizeof(FreeListNode) + last_node->length != programBreak)
     {
-        if (contiguous_block_count == 0)
-        {
-            // Start a new contiguous block sequence
-            total_free_size += current_node->length;
-            contiguous_blocks[contiguous_block_count++] = current_node;
-        }
-        else
-        {
-            // Check if the current block is contiguous with the previous one
-            if (current_node == (void *)(current_node->prev) + ((current_node->prev->length) + sizeof(FreeListNode)))
-            {
-                // If contiguous, add the block size and include it in the sequence
-                total_free_size += (current_node->length + sizeof(FreeListNode));
-                contiguous_blocks[contiguous_block_count++] = current_node;
-            }
-            else
-            {
-                // If not contiguous, reset the sequence and start a new one
-                contiguous_block_count = 0;
-                total_free_size = 0;
-                total_free_size += current_node->length;
-                contiguous_blocks[contiguous_block_count++] = current_node;
-            }
-        }
-        current_node = current_node->next;
+        return 0;
     }
 
-    // Check if the total contiguous free size exceeds 128 KB
-    if (total_free_size > (128 * 1024))
+    // The reserved part of the process heap stays mapped, only the part of the block above it counts
+    lowest_break = (char *)last_node;
+    if (activeRegion == NULL && lowest_break < reservedBreak)
     {
-        decrease_count++;  // Initial decrement for the first 128 KB
-        contiguous_blocks[contiguous_block_count] = NULL;
-        uint32_t i = 0;
-
-        // Remove the contiguous blocks from the free list
-        while (contiguous_blocks[i] != NULL)
-        {
-            remove_freelist_node(contiguous_blocks[i]);
-            i++;
-        }
+        lowest_break = reservedBreak;
+    }
+    if (lowest_break >= programBreak)
+    {
+        return 0;
+    }
 
-        // Calculate additional decreases in program break for every extra 128 KB
-        uint8_t remaining_size = (total_free_size - (128 * 1024));
-        while (remaining_size > (128 * 1024))
-        {
-            decrease_count++;
-            remaining_size -= (128 * 1024);
-        }
+    // Check if the free size at the top exceeds one trim chunk
+    chunk_count = (uint64_t)(programBreak - lowest_break - 1) / tuneConfig.trimSize;
+    if (chunk_count == 0)
+    {
+        return 0;
+    }
 
-        // If there is any remaining memory, reinsert it into the free list
-        if (remaining_size > sizeof(FreeListNode))
-        {
-            FreeListNode *new_node = contiguous_blocks[0];
-            *(uint64_t *)new_node = remaining_size;
-            insert_block_into_freelist(((void *)new_node) + sizeof(FreeListNode));
-        }
+    // Stop at a page boundary, and leave either nothing or a whole free block below it
+    new_break = programBreak - chunk_count * tuneConfig.trimSize;
+    new_break = (char *)(((uintptr_t)new_break + page_size - 1) & ~(page_size - 1));
+    if (new_break > (char *)last_node && (uint64_t)(new_break - (char *)last_node) < sizeof(FreeListNode) + FREE_NODE_MIN_LENGTH)
+    {
+        new_break += page_size;
+    }
+    if (new_break >= programBreak)
+    {
+        return 0;
     }
 
-    return decrease_count;
+    return (uint64_t)(programBreak - new_break);
 }
 
-void insert_block_into_freelist(void *blockPtr)
+/**
+ * @brief Maps a free block length to its size-class bin.
+ *
+ * Lengths below 128 bytes get one bin per 8 bytes. Larger lengths are split by power of two and then into
+ * four sub-ranges, so the blocks in a bin differ by less than 25% in size.
+ *
+ * @param length Length of a free block in bytes.
+ * @return uint32_t Bin number, below FREE_BIN_COUNT.
+ */
+uint32_t free_bin_index_of(uint64_t length)
 {
-   // If the freelist is empty or the new block should be placed at the start
-    if (FreeListHead == NULL || (blockPtr - sizeof(FreeListNode)) < (void *)FreeListHead)
+    uint32_t powerOfTwo = 0;
+
+    if (length < 128)
     {
-        insert_node_at_start(blockPtr);
+        return length >> 3;
     }
-    // If there is only one node in the freelist
-    else if (FreeListHead->next == NULL)
+
+    powerOfTwo = 63 - __builtin_clzll(length);
+    return 16 + (powerOfTwo - 7) * 4 + ((length >> (powerOfTwo - 2)) & 3);
+}
+
+/**
+ * @brief Finds the first non-empty bin at or after `bin` by scanning the occupancy bitmap with ctz.
+ *
+ * @return uint32_t The bin number, or FREE_BIN_COUNT if every remaining bin is empty.
+ */
+static uint32_t find_next_bin(uint32_t bin)
+{
+    uint32_t word = bin >> 6;
+    uint64_t bits = 0;
+
+    if (bin >= FREE_BIN_COUNT)
     {
-        append_to_freelist_end(blockPtr);
+        return FREE_BIN_COUNT;
     }
-    else
-    {
-        FreeListNode *currentNode = FreeListHead->next;
 
-        // Traverse the freelist to find the correct position to insert the block
-        while (currentNode != NULL)
-        {
-            if ((blockPtr - sizeof(FreeListNode)) < (void *)currentNode)
-            {
-                insert_node_between(currentNode, blockPtr);
-                break;
-            }
-            currentNode = currentNode->next;
-        }
-
-        // If the correct position wasn't found, insert the block at the end
-        if (currentNode == NULL)
+    bits = freeBinIndex->nonEmpty[word] & (~0ULL << (bin & 63));
+    while (bits == 0)
+    {
+        if (++word == FREE_BIN_WORDS)
         {
-            append_to_freelist_end(blockPtr);
+            return FREE_BIN_COUNT;
         }
+        bits = freeBinIndex->nonEmpty[word];
     }
+
+    return (word << 6) + __builtin_ctzll(bits);
 }
 
-void insert_node_at_start(void *blockPtr)
+/**
+ * @brief Adds a free block to the front of the bin for its length.
+ */
+void bin_insert(FreeListNode *node)
 {
-     // Adjust the pointer to point to the new node, considering the node's size
-    FreeListNode *newNode = (FreeListNode *)(blockPtr - sizeof(FreeListNode));
-    
-    // Check if the freelist is empty
-    if (FreeListHead == NULL)
-    {       
-        // Set the new node as the head of the freelist
-        FreeListHead = newNode;
-        FreeListHead->length = newNode->length; 
-        FreeListHead->prev = NULL;
-	FreeListHead->next = NULL;
-    }
-    else
+    uint32_t bin = free_bin_index_of(node->length);
+    FreeBinLinks *links = FREE_BIN_LINKS(node);
+
+    links->binPrev = NULL;
+    links->binNext = freeBinIndex->bins[bin];
+    if (links->binNext != NULL)
     {
-        // Temporarily store the current head of the freelist
-        FreeListNode *oldHead = FreeListHead;
-    
-	// Set the new head of the freelist to the block being inserted
-        FreeListHead = newNode ;
-     
-    	// Initialize the new head's length field
-        FreeListHead->length = newNode->length; 
-    
-	// The new head has no previous node, so set prev to NULL
-	FreeListHead->prev = NULL;
-    
-        // Link the new head to the old head
-        FreeListHead->next = oldHead;
-
-        // Update previous pointer to the new head
-        oldHead->prev = FreeListHead;
+        FREE_BIN_LINKS(links->binNext)->binPrev = node;
     }
+    freeBinIndex->bins[bin] = node;
+    freeBinIndex->nonEmpty[bin >> 6] |= 1ULL << (bin & 63);
 }
-void append_to_freelist_end(void *blockPtr)
-{ 
-    // Create a pointer to the new node, adjusting for the node's size
-    FreeListNode *newNode = (FreeListNode *)(blockPtr - sizeof(FreeListNode));
-
-    // Check if the freelist contains only one node
-    if (FreeListHead->next == NULL)
-    {
-        // The new node's previous pointer should point to the current head of the freelist
-        newNode->prev = FreeListHead;
 
-        // Since this will be the last node, set its next pointer to NULL
-        newNode->next = NULL;
+/**
+ * @brief Removes a free block from its bin. The block's length must not have changed since bin_insert.
+ */
+void bin_remove(FreeListNode *node)
+{
+    uint32_t bin = free_bin_index_of(node->length);
+    FreeBinLinks *links = FREE_BIN_LINKS(node);
 
-        // Update the current head's next pointer to link to the new node
-        FreeListHead->next = newNode;
+    if (links->binPrev != NULL)
+    {
+        FREE_BIN_LINKS(links->binPrev)->binNext = links->binNext;
     }
     else
     {
-        // Traverse the list to find the last node
-        FreeListNode *currentNode = FreeListHead->next;
-        while (currentNode->next != NULL)
+        freeBinIndex->bins[bin] = links->binNext;
+        if (links->binNext == NULL)
         {
-            currentNode = currentNode->next;
+            freeBinIndex->nonEmpty[bin >> 6] &= ~(1ULL << (bin & 63));
         }
-
-        // Set the new node's previous pointer to the last node
-        newNode->prev = currentNode;
-
-        // Set the new node's next pointer to NULL as it will be the last node
-        newNode->next = NULL;
-
-        // Update the last node's next pointer to point to the new node
-        currentNode->next = newNode;
+    }
+    if (links->binNext != NULL)
+    {
+        FREE_BIN_LINKS(links->binNext)->binPrev = links->binPrev;
     }
 }
 
-void insert_node_between(FreeListNode *currentNodePtr, void *blockPtr)
+/**
+ * @brief Inserts a block into the free list and merges it with adjacent free blocks.
+ *
+ * The neighbours are found from the block itself: the block after it starts where it ends, and the free block
+ * before it, if any, is recorded in its header. Because neighbours are merged on insertion, no two free blocks
+ * are ever adjacent, and the merged block is filed in the bin for its new length. A merged-away header that
+ * compaction was going to resume at is replaced by the header of the merged block.
+ *
+ * @param blockPtr Pointer to the memory after the block's node header; the header's length must be set, its prev
+ *                 must be BLOCK_IN_USE, and its next the free block that ends where it starts, or NULL.
+ * @return FreeListNode* Header of the free block the block ended up in.
+ */
+FreeListNode *insert_block_into_freelist(void *blockPtr)
 {
-    // Save the current node to a temporary variable
-    FreeListNode *targetNode = currentNodePtr;
-
-    // Create a new node at the specified block pointer, adjusting for the node's size
     FreeListNode *newNode = (FreeListNode *)(blockPtr - sizeof(FreeListNode));
+    FreeListNode *previousNode = newNode->next;
+    FreeListNode *nextNode = (FreeListNode *)(blockPtr + newNode->length);
 
-    // Update the new node's pointers to link between the previous and current nodes
-    newNode->prev = targetNode->prev;
-    newNode->next = targetNode;
+    // The node header and bin links are about to be written, so those bytes are no longer known to be zero
+    mark_range_dirty(newNode, sizeof(FreeListNode) + sizeof(FreeBinLinks));
 
-    // Update the previous node's next pointer to point to the new node
-    targetNode->prev->next = newNode;
+    // Absorb the following block if it is free
+    if ((char *)nextNode < programBreak && BLOCK_IS_FREE(nextNode))
+    {
+        HMM_STATS_COUNT(HMM_EVENT_COALESCE);
+        remove_freelist_node(nextNode);
+        newNode->length += sizeof(FreeListNode) + nextNode->length;
+        if (compactResume == nextNode)
+        {
+            compactResume = newNode;
+        }
+    }
 
-    // Update the target node's previous pointer to point to the new node
-    targetNode->prev = newNode;
+    // Merge into the preceding block if it is free
+    if (previousNode != NULL)
+    {
+        HMM_STATS_COUNT(HMM_EVENT_COALESCE);
+        remove_freelist_node(previousNode);
+        previousNode->length += sizeof(FreeListNode) + newNode->length;
+        if (compactResume == newNode)
+        {
+            compactResume = previousNode;
+        }
+        newNode = previousNode;
+    }
+
+    // Record the free block in the header of the block after it, or as the tail if it reaches the break
+    nextNode = (FreeListNode *)((char *)newNode + sizeof(FreeListNode) + newNode->length);
+    if ((char *)nextNode < programBreak)
+    {
+        nextNode->next = newNode;
+    }
+    else
+    {
+        freeBinIndex->tail = newNode;
+    }
+
+    // Link it at the head of the free list
+    newNode->prev = NULL;
+    newNode->next = FreeListHead;
+    if (FreeListHead != NULL)
+    {
+        FreeListHead->prev = newNode;
+    }
+    FreeListHead = newNode;
+    bin_insert(newNode);
+
+    return newNode;
 }
 
 /**
  * @brief Removes a node from the freelist.
  * 
- * This function removes a node from the freelist, updating the relevant pointers.
- * If the node to be removed is the head of the list, the head pointer is updated.
- * Handles cases where the node is at the start, middle, or end of the list.
+ * This function unlinks a node from the freelist and from its size-class bin, updating the head pointer when
+ * the node is at the start of the list. The block is marked as in use, and the block after it, or the tail if
+ * it reached the program break, no longer refers to it.
  * 
  * @param nodePtr Pointer to the node to be removed from the freelist.
  */
 void remove_freelist_node(void *nodePtr)
 {
-    FreeListNode *currentNode = FreeListHead;
+    FreeListNode *currentNode = (FreeListNode *)nodePtr;
+    FreeListNode *followingNode = (FreeListNode *)((char *)currentNode + sizeof(FreeListNode) + currentNode->length);
 
-    // If the node to be removed is the head of the list
-    if (currentNode == nodePtr)
+    bin_remove(currentNode);
+
+    if (currentNode->prev != NULL)
     {
-        // If there is another node after the head, update the head
-        if (currentNode->next != NULL)
-        {
-            FreeListHead = FreeListHead->next;
-            FreeListHead->prev = NULL;
-        }
-        else
-        {
-            // If the head is the only node, set the head to NULL
-            FreeListHead = NULL;
-        }
+        currentNode->prev->next = currentNode->next;
     }
     else
     {
-        currentNode = currentNode->next;
+        FreeListHead = currentNode->next;
+    }
 
-        // Traverse the list to find the node to remove
-        while (currentNode != NULL)
-        {
-            if (currentNode == nodePtr)
-            {
-                // If the node is not the last node
-                if (currentNode->next != NULL)
-                {
-                    FreeListNode *previousNode = currentNode->prev;
-                    currentNode = currentNode->next;
-                    previousNode->next = currentNode;
-                    currentNode->prev = previousNode;
-                }
-                else
-                {
-                    // If the node is the last node, just update the previous node's next pointer
-                    currentNode = currentNode->prev;
-                    currentNode->next = NULL;
-                }
-                break;
-            }
-            currentNode = currentNode->next;
-        }
+    if (currentNode->next != NULL)
+    {
+        currentNode->next->prev = currentNode->prev;
+    }
+
+    if ((char *)followingNode < programBreak)
+    {
+        followingNode->next = NULL;
+    }
+    else
+    {
+        freeBinIndex->tail = NULL;
     }
+
+    currentNode->prev = BLOCK_IN_USE;
+    currentNode->next = NULL;
 }
+
 /**
  * @brief Searches for the best-fit block in the freelist for a given size.
  *
- * This function searches through the freelist to find the best-fit memory block 
- * for a requested size. It considers both individual blocks and fragmented blocks 
- * (adjacent free blocks) to find the most optimal match. The function returns 
- * a pointer to the allocated memory block.
+ * This function looks at the first FREE_BIN_SCAN_LIMIT blocks of the size-class bin of the requested size for
+ * the smallest block that fits, since blocks in that bin can be slightly smaller than requested. If none of them
+ * fits, the occupancy bitmap gives the first non-empty larger bin, where every block fits, and its first block
+ * is used. The scan is capped so that a bin full of blocks that are just too small costs a few cache misses,
+ * not a walk of the whole bin. The block is split if the rest can hold another free block.
  *
  * @param requestedSize The size of memory block required.
  * @return void* Pointer to the allocated memory block, or NULL if no suitable block is found.
  */
 void *find_best_fit_block(uint64_t requestedSize)
 {
-    // Variables used for fragmentation handling
-    uint8_t fragmentCount = 0;
-    uint8_t isFragment = 0;
-    uint64_t currentFreeSize = 0;
-    uint64_t minFragmentSize = 0;
-    FreeListNode *fragmentedBlocks[10000] = {0};
-    FreeListNode *bestFragmentedBlocks[10000] = {0};
-
-    // Variables for tracking the best-fit block
-    uint8_t foundMinBlock = 0;
-    void *allocatedBlock = NULL;
+    uint32_t bin = free_bin_index_of(requestedSize);
     FreeListNode *bestFitBlock = NULL;
-    FreeListNode *currentNode = FreeListHead;
-    uint64_t minBlockSize = 0;
+    FreeListNode *currentNode = NULL;
+    uint32_t scanned = 0;
 
     /*******************************************************************************/
-    /*                  Search for the minimum suitable block (Best Fit)           */
+    /*          Search the front of the request's own bin for the best fit         */
     /*******************************************************************************/
-    while (currentNode != NULL)
+    for (currentNode = freeBinIndex->bins[bin]; currentNode != NULL && scanned < FREE_BIN_SCAN_LIMIT;
+         currentNode = FREE_BIN_LINKS(currentNode)->binNext, scanned++)
     {
-        // Identify the smallest block that fits the requested size
-        if (currentNode->length >= requestedSize && foundMinBlock == 0)
+        if (currentNode->length >= requestedSize && (bestFitBlock == NULL || currentNode->length < bestFitBlock->length))
         {
-            minBlockSize = currentNode->length;
-            bestFitBlock = currentNode;
-            foundMinBlock = 1;
-        }
-        else if (foundMinBlock == 1 && currentNode->length < minBlockSize && currentNode->length >= requestedSize)
-        {
-            minBlockSize = currentNode->length;
             bestFitBlock = currentNode;
+            if (currentNode->length == requestedSize)
+            {
+                break;
+            }
         }
-        currentNode = currentNode->next;
     }
 
-    /***************************************************************************/
-    /*                          Fragmentation (Best Fit)                       */
-    /***************************************************************************/
-    currentNode = FreeListHead;
-    while (currentNode != NULL)
+    /*******************************************************************************/
+    /*             Otherwise take a block from the next non-empty bin              */
+    /*******************************************************************************/
+    if (bestFitBlock == NULL)
     {
-        isFragment = 0;
-        if (fragmentCount == 0)
+        bin = find_next_bin(bin + 1);
+        if (bin == FREE_BIN_COUNT)
         {
-            currentFreeSize += currentNode->length;
-            fragmentedBlocks[fragmentCount++] = currentNode;
+            HMM_STATS_COUNT(HMM_EVENT_FREELIST_MISS);
+            return NULL;
         }
-        else
+        bestFitBlock = freeBinIndex->bins[bin];
+    }
+
+    /***********************************************************************/
+    /*               Split off the remainder of the block                  */
+    /***********************************************************************/
+    remove_freelist_node(bestFitBlock);
+    uint64_t remainingSize = bestFitBlock->length - requestedSize;
+    if (remainingSize >= sizeof(FreeListNode) + FREE_NODE_MIN_LENGTH)
+    {
+        bestFitBlock->length = requestedSize;
+        FreeListNode *newNode = (FreeListNode *)((void *)bestFitBlock + requestedSize + sizeof(FreeListNode));
+        newNode->length = remainingSize - sizeof(FreeListNode);
+        newNode->prev = BLOCK_IN_USE;
+        newNode->next = NULL;
+        insert_block_into_freelist((void *)newNode + sizeof(FreeListNode));
+    }
+
+    return (void *)((char *)bestFitBlock + sizeof(FreeListNode));
+}
+
+/**
+ * @brief Records that a region of memory is known to contain only zero bytes.
+ *
+ * Called for memory the kernel has just zeroed (fresh pages from the program break, or pages
+ * released with MADV_DONTNEED). The range is merged into an adjacent or overlapping entry when
+ * possible. If the table is full the range is simply not recorded, which only costs a later memset.
+ *
+ * @param start Start address of the zeroed region.
+ * @param length Length of the zeroed region in bytes.
+ */
+void mark_range_zeroed(void *start, uint64_t length)
+{
+    uint8_t *rangeStart = (uint8_t *)start;
+    uint8_t *rangeEnd = rangeStart + length;
+    uint32_t i = 0;
+
+    if (length == 0)
+    {
+        return;
+    }
+
+    // Extend an existing range if the new one touches or overlaps it
+    for (i = 0; i < zeroRangeCount; i++)
+    {
+        if (rangeStart <= zeroRanges[i].end && rangeEnd >= zeroRanges[i].start)
         {
-            // Check if the current node is contiguous with the previous one
-            if (currentNode == (void *)(currentNode->prev) + (currentNode->prev->length + sizeof(FreeListNode)))
+            if (rangeStart < zeroRanges[i].start)
             {
-                currentFreeSize += (currentNode->length + sizeof(FreeListNode));
-                fragmentedBlocks[fragmentCount++] = currentNode;
+                zeroRanges[i].start = rangeStart;
             }
-            else
+            if (rangeEnd > zeroRanges[i].end)
             {
-                // Reset if not contiguous
-                fragmentCount = 0;
-                currentFreeSize = 0;
-                currentFreeSize += currentNode->length;
-                fragmentedBlocks[fragmentCount++] = currentNode;
+                zeroRanges[i].end = rangeEnd;
             }
+            return;
         }
+    }
+
+    // Otherwise record it as a new range if there is room left
+    if (zeroRangeCount < ZERO_RANGE_MAX)
+    {
+        zeroRanges[zeroRangeCount].start = rangeStart;
+        zeroRanges[zeroRangeCount].end = rangeEnd;
+        zeroRangeCount++;
+    }
+}
 
-        // Update the best fragmented block sequence if a better fit is found
-        if (currentFreeSize >= requestedSize && fragmentCount > 1 && minFragmentSize == 0)
+/**
+ * @brief Removes a region of memory from the known-zero ranges.
+ *
+ * Must be called whenever bytes inside a free region may have been written: node headers being
+ * initialised, user blocks being returned by HmmFree, or memory being handed back to the kernel.
+ * Ranges are clipped or split around the dirty region.
+ *
+ * @param start Start address of the dirtied region.
+ * @param length Length of the dirtied region in bytes.
+ */
+void mark_range_dirty(void *start, uint64_t length)
+{
+    uint8_t *dirtyStart = (uint8_t *)start;
+    uint8_t *dirtyEnd = dirtyStart + length;
+    uint32_t i = 0;
+
+    while (i < zeroRangeCount)
+    {
+        ZeroRange *range = &zeroRanges[i];
+
+        // No overlap with this range
+        if (dirtyEnd <= range->start || dirtyStart >= range->end)
         {
-            isFragment = 1;
-            minFragmentSize = currentFreeSize;
-            memcpy(bestFragmentedBlocks, fragmentedBlocks, sizeof(fragmentedBlocks));
-            fragmentCount = 0;
-            currentFreeSize = 0;
+            i++;
+            continue;
         }
-        else if (currentFreeSize >= requestedSize && currentFreeSize < minFragmentSize && fragmentCount > 1)
+
+        if (dirtyStart <= range->start && dirtyEnd >= range->end)
         {
-            isFragment = 1;
-            minFragmentSize = currentFreeSize;
-            memcpy(bestFragmentedBlocks, fragmentedBlocks, sizeof(fragmentedBlocks));
-            fragmentCount = 0;
-            currentFreeSize = 0;
+            // The whole range is dirty, replace it with the last entry and re-check this slot
+            *range = zeroRanges[--zeroRangeCount];
+            continue;
         }
 
-        if (!isFragment)
+        if (dirtyStart <= range->start)
         {
-            currentNode = currentNode->next;
+            // Dirty region covers the front of the range
+            range->start = dirtyEnd;
         }
-    }
-
-    /***********************************************************************/
-    /*               Determine the most optimal memory block               */
-    /***********************************************************************/
-    if (minFragmentSize != 0 && foundMinBlock == 1)
-    {
-        // Choose the smaller between the best fit and the best fragmented fit
-        if (minFragmentSize < minBlockSize)
+        else if (dirtyEnd >= range->end)
         {
-            int i = 0;
-            allocatedBlock = bestFragmentedBlocks[0];
-            *(size_t *)(allocatedBlock) = requestedSize;
-            while (bestFragmentedBlocks[i] != NULL)
-            {
-                remove_freelist_node(bestFragmentedBlocks[i]);
-                i++;
-            }
-            size_t remainingSize = minFragmentSize - requestedSize;
-            if (remainingSize > sizeof(FreeListNode))
-            {
-                FreeListNode *newNode = (FreeListNode *)((void *)allocatedBlock + requestedSize + sizeof(FreeListNode));
-                *(size_t *)newNode = remainingSize - sizeof(FreeListNode);
-                insert_block_into_freelist((void *)newNode + sizeof(FreeListNode));
-            }
+            // Dirty region covers the back of the range
+            range->end = dirtyStart;
         }
         else
         {
-            allocatedBlock = bestFitBlock;
-            remove_freelist_node(allocatedBlock);
-            size_t remainingSize = bestFitBlock->length - requestedSize;
-            if (remainingSize > sizeof(FreeListNode))
+            // Dirty region is in the middle, split the range in two
+            uint8_t *tailEnd = range->end;
+            range->end = dirtyStart;
+            if (zeroRangeCount < ZERO_RANGE_MAX)
             {
-                *(size_t *)(allocatedBlock) = requestedSize;
-                FreeListNode *newNode = (FreeListNode *)((void *)allocatedBlock + requestedSize + sizeof(FreeListNode));
-                *(size_t *)newNode = remainingSize - sizeof(FreeListNode);
-                insert_block_into_freelist((void *)newNode + sizeof(FreeListNode));
+                zeroRanges[zeroRangeCount].start = dirtyEnd;
+                zeroRanges[zeroRangeCount].end = tailEnd;
+                zeroRangeCount++;
             }
         }
+        i++;
     }
-    else if (minFragmentSize != 0)
+}
+
+/**
+ * @brief Zeroes only the bytes of a block that are not already known to be zero.
+ *
+ * Walks the block from start to end, skipping over parts covered by a known-zero range and
+ * calling memset on the gaps in between. A block carved entirely from fresh memory is not
+ * touched at all.
+ *
+ * @param ptr Pointer to the start of the user memory to clear.
+ * @param size Number of bytes to clear.
+ */
+void clear_dirty_bytes(void *ptr, uint64_t size)
+{
+    uint8_t *cursor = (uint8_t *)ptr;
+    uint8_t *end = cursor + size;
+    uint32_t i = 0;
+
+    while (cursor < end)
     {
-        // If no single block is found, but fragmented blocks are
-        uint32_t i = 0;
-        allocatedBlock = bestFragmentedBlocks[0];
-        *(uint64_t *)(allocatedBlock) = requestedSize;
-        while (bestFragmentedBlocks[i] != NULL)
+        uint8_t *nextZero = end;      // Start of the nearest zero range after the cursor
+        uint8_t isZero = 0;
+
+        for (i = 0; i < zeroRangeCount; i++)
         {
-            remove_freelist_node(bestFragmentedBlocks[i]);
-            i++;
+            if (zeroRanges[i].start <= cursor && cursor < zeroRanges[i].end)
+            {
+                // Cursor is inside a known-zero range, skip to its end
+                cursor = (zeroRanges[i].end < end) ? zeroRanges[i].end : end;
+                isZero = 1;
+                break;
+            }
+            if (zeroRanges[i].start > cursor && zeroRanges[i].start < nextZero)
+            {
+                nextZero = zeroRanges[i].start;
+            }
         }
-        uint64_t remainingSize = minFragmentSize - requestedSize;
-        if (remainingSize > sizeof(FreeListNode))
+
+        if (!isZero)
         {
-            FreeListNode *newNode = (FreeListNode *)((void *)allocatedBlock + requestedSize + sizeof(FreeListNode));
-            *(uint64_t *)newNode = remainingSize - sizeof(FreeListNode);
-            insert_block_into_freelist((void *)newNode + sizeof(FreeListNode));
+            // Clear the gap up to the next known-zero range
+            memset(cursor, 0, nextZero - cursor);
+            cursor = nextZero;
         }
     }
-    else if (foundMinBlock == 1)
+}
+
+/**
+ * @brief Returns the whole pages inside free blocks to the kernel.
+ *
+ * For every free block, the pages that lie entirely after its node header and bin links are released with
+ * MADV_DONTNEED. The addresses stay valid and read back as zero, so the released ranges are recorded
+ * with mark_range_zeroed and a later HmmCalloc does not need to clear them again.
+ *
+ * @return uint64_t The number of bytes released.
+ */
+uint64_t release_free_pages(void)
+{
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t releasedBytes = 0;
+    FreeListNode *currentNode = FreeListHead;
+
+    while (currentNode != NULL)
     {
-        // If a best fit block is found but no fragmented blocks
-        allocatedBlock = (void *)bestFitBlock;
-        remove_freelist_node(allocatedBlock);
-        uint64_t remainingSize = bestFitBlock->length - requestedSize;
-        if (remainingSize > sizeof(FreeListNode))
+        // Keep the node header and bin links, which live at the start of the block
+        uintptr_t linksEnd = (uintptr_t)currentNode + sizeof(FreeListNode) + sizeof(FreeBinLinks);
+        uintptr_t pagesStart = (linksEnd + pageSize - 1) & ~(pageSize - 1);
+        uintptr_t pagesEnd = ((uintptr_t)currentNode + sizeof(FreeListNode) + currentNode->length) & ~(pageSize - 1);
+
+        if (pagesEnd > pagesStart && madvise((void *)pagesStart, pagesEnd - pagesStart, MADV_DONTNEED) == 0)
         {
-            *(uint64_t *)(allocatedBlock) = requestedSize;
-            FreeListNode *newNode = (FreeListNode *)((void *)allocatedBlock + requestedSize + sizeof(FreeListNode));
-            *(uint64_t *)newNode = remainingSize - sizeof(FreeListNode);
-            insert_block_into_freelist((void *)newNode + sizeof(FreeListNode));
+            mark_range_zeroed((void *)pagesStart, pagesEnd - pagesStart);
+            releasedBytes += pagesEnd - pagesStart;
+            HMM_STATS_COUNT(HMM_EVENT_PAGES_RELEASED);
         }
+        currentNode = currentNode->next;
     }
 
-    return (void *)((char *)allocatedBlock + sizeof(FreeListNode));
+    return releasedBytes;
 }
-
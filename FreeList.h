@@ -1,18 +1,61 @@
 #ifndef FreeList
 #define FreeList
-// Define the FreeListNode structure
+// Define the FreeListNode structure: header of every block. In a free block, prev and next link the free list;
+// in a block that is not free, prev is BLOCK_IN_USE and next is the free block that ends where it starts, if any.
 typedef struct FreeListNode {
     uint64_t length;
     struct FreeListNode *prev;
     struct FreeListNode *next;
 } FreeListNode;
 
+#define BLOCK_IN_USE ((FreeListNode *)1)        /* prev of a block that is not in the free list */
+
+// Whether a block header belongs to a free block
+#define BLOCK_IS_FREE(node) ((node)->prev != BLOCK_IN_USE)
+
+#define FREE_BIN_COUNT 256                      /* Number of size-class bins for free blocks */
+#define FREE_BIN_WORDS (FREE_BIN_COUNT / 64)    /* 64-bit words in the bin occupancy bitmap */
+#define FREE_NODE_MIN_LENGTH 16                 /* Smallest free block, large enough for its bin links */
+#define FREE_BIN_SCAN_LIMIT 8                   /* Blocks of the request's own bin looked at before a larger bin */
+
+// Define the FreeBinLinks structure: links of a free block within its size-class bin, kept right after the node
+typedef struct FreeBinLinks {
+    FreeListNode *binPrev;
+    FreeListNode *binNext;
+} FreeBinLinks;
+
+// Bin links of a free block
+#define FREE_BIN_LINKS(node) ((FreeBinLinks *)((FreeListNode *)(node) + 1))
+
+// Define the FreeBinIndex structure: free blocks grouped by size class, plus a bitmap of non-empty bins
+typedef struct FreeBinIndex {
+    FreeListNode *bins[FREE_BIN_COUNT];
+    uint64_t nonEmpty[FREE_BIN_WORDS];
+    FreeListNode *tail;                   // Free block that ends at the program break, NULL if the top block is in use
+} FreeBinIndex;
+
+// Bins of the heap currently being operated on
+extern FreeBinIndex *freeBinIndex;
+
+// Maximum number of known-zero address ranges tracked at once
+#define ZERO_RANGE_MAX 64
+
+// Define the ZeroRange structure: a free region [start, end) known to contain only zero bytes
+typedef struct ZeroRange {
+    uint8_t *start;
+    uint8_t *end;
+} ZeroRange;
+
 // Function declarations
-uint8_t calculate_decreases_in_program_break();
-void insert_block_into_freelist(void *blockPtr);
-void insert_node_at_start(void *ptr);
-void append_to_freelist_end(void *blockPtr);
-void insert_node_between(FreeListNode *currentNodePtr, void *blockPtr);
+uint64_t calculate_decreases_in_program_break();
+FreeListNode *insert_block_into_freelist(void *blockPtr);
+uint32_t free_bin_index_of(uint64_t length);
+void bin_insert(FreeListNode *node);
+void bin_remove(FreeListNode *node);
 void remove_freelist_node(void *nodePtr);
 void *find_best_fit_block(uint64_t requestedSize);
+void mark_range_zeroed(void *start, uint64_t length);
+void mark_range_dirty(void *start, uint64_t length);
+void clear_dirty_bytes(void *ptr, uint64_t size);
+uint64_t release_free_pages(void);
 #endif
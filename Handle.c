@@ -0,0 +1,247 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "heap.h"
+#include "FreeList.h"
+#include "Handle.h"
+#include "Reclaim.h"
+
+extern FreeListNode *FreeListHead;
+extern char *programBreak;
+extern char *heapStart;
+
+// Handle table. Entry 0 is never used so that 0 can mean "no handle".
+HandleEntry handleTable[HANDLE_MAX];
+
+// Head of the list of recycled entries, and the first entry that has never been used
+uint32_t handleFreeHead = 0;
+uint32_t handleNextUnused = 1;
+
+// Header of the block where the next HmmCompact step resumes. Kept valid by insert_block_into_freelist and
+// HmmRealloc when they merge the block away; NULL starts a new pass at the bottom of the heap.
+FreeListNode *compactResume = NULL;
+
+// Bytes moved by the compaction pass in progress
+size_t compactPassMoved = 0;
+
+/**
+ * @brief Checks whether a block header belongs to a handle block that is currently allowed to move.
+ *
+ * A handle block stores a tag (HANDLE_MAGIC and its handle) in its first word. The tag is only trusted
+ * if the handle table points back at the same block, so an ordinary block can never be mistaken for one.
+ *
+ * @param header Address of the block header.
+ * @return HmmHandle The handle owning the block, or 0 if it is not an unlocked handle block.
+ */
+static HmmHandle movable_handle_at(void *header)
+{
+    void *userPtr = header + sizeof(FreeListNode);
+    uint64_t tag = 0;
+    uint32_t handle = 0;
+
+    if ((char *)userPtr + sizeof(uint64_t) > programBreak)
+    {
+        return 0;
+    }
+
+    tag = *(uint64_t *)userPtr;
+    handle = (uint32_t)tag;
+    if ((tag >> 32) != HANDLE_MAGIC || handle == 0 || handle >= HANDLE_MAX)
+    {
+        return 0;
+    }
+    if (handleTable[handle].block != userPtr || handleTable[handle].lockCount != 0)
+    {
+        return 0;
+    }
+
+    return handle;
+}
+
+/**
+ * @brief Allocates a relocatable block and returns a handle to it.
+ *
+ * The block must be locked with HmmHandleLock to get a pointer to its memory. While no lock is held,
+ * HmmCompact may move the block to close the free space below it.
+ *
+ * @param size Size of the block in bytes.
+ * @return HmmHandle Handle to the block, or 0 if the allocation fails or the handle table is full.
+ */
+HmmHandle HmmHandleAlloc(size_t size)
+{
+    uint32_t handle = 0;
+    void *block = NULL;
+
+    // Take a recycled entry if there is one, otherwise a never-used one
+    if (handleFreeHead != 0)
+    {
+        handle = handleFreeHead;
+    }
+    else if (handleNextUnused < HANDLE_MAX)
+    {
+        handle = handleNextUnused;
+    }
+    else
+    {
+        return 0;
+    }
+
+    // The first word of the block holds the tag that lets the compactor find the handle
+    block = HmmAlloc(size + sizeof(uint64_t));
+    if (block == NULL)
+    {
+        return 0;
+    }
+
+    if (handle == handleFreeHead)
+    {
+        handleFreeHead = handleTable[handle].nextFree;
+    }
+    else
+    {
+        handleNextUnused++;
+    }
+
+    *(uint64_t *)block = (HANDLE_MAGIC << 32) | handle;
+    handleTable[handle].block = block;
+    handleTable[handle].lockCount = 0;
+    handleTable[handle].nextFree = 0;
+
+    return handle;
+}
+
+/**
+ * @brief Frees a handle and its block. The handle must not be locked.
+ *
+ * @param handle Handle returned by HmmHandleAlloc. 0 is ignored.
+ */
+void HmmHandleFree(HmmHandle handle)
+{
+    if (handle == 0 || handle >= HANDLE_MAX || handleTable[handle].block == NULL)
+    {
+        return;
+    }
+
+    HmmFree(handleTable[handle].block);
+    handleTable[handle].block = NULL;
+    handleTable[handle].lockCount = 0;
+    handleTable[handle].nextFree = handleFreeHead;
+    handleFreeHead = handle;
+}
+
+/**
+ * @brief Pins a handle's block in place and returns a pointer to its memory.
+ *
+ * Locks nest; the block stays in place until every lock has been released with HmmHandleUnlock.
+ *
+ * @param handle Handle returned by HmmHandleAlloc.
+ * @return void* Pointer to the block's memory, valid until the matching unlock, or NULL for an invalid handle.
+ */
+void *HmmHandleLock(HmmHandle handle)
+{
+    if (handle == 0 || handle >= HANDLE_MAX || handleTable[handle].block == NULL)
+    {
+        return NULL;
+    }
+
+    handleTable[handle].lockCount++;
+    return handleTable[handle].block + sizeof(uint64_t);
+}
+
+/**
+ * @brief Releases one lock on a handle, allowing its block to move again once no locks remain.
+ *
+ * @param handle Handle returned by HmmHandleAlloc.
+ */
+void HmmHandleUnlock(HmmHandle handle)
+{
+    if (handle == 0 || handle >= HANDLE_MAX || handleTable[handle].lockCount == 0)
+    {
+        return;
+    }
+
+    handleTable[handle].lockCount--;
+}
+
+/**
+ * @brief Runs one bounded step of heap compaction.
+ *
+ * Walks the heap in address order. Whenever the block right after a free block is an unlocked handle block,
+ * the handle block is slid down into the hole and the hole reappears above it, where it merges with any free
+ * block that follows. The growing hole is carried upwards, so every block moves at most once on its way to the
+ * top of the heap, where trim_program_break can give the space back to the kernel. Blocks that are not handles,
+ * or are locked, stay put and the walk goes on past them.
+ *
+ * Both moving a block and stepping over one are charged to `budgetBytes`, stepping over costing
+ * COMPACT_VISIT_COST, so a step stays short however fragmented the heap is. The next step resumes where this
+ * one stopped; a pass ends at the program break and the one after it starts again at the bottom of the heap.
+ *
+ * @param budgetBytes Maximum number of bytes to move or walk in this step.
+ * @return size_t Budget used by the step, or 0 once a whole pass has found nothing to move.
+ */
+size_t HmmCompact(size_t budgetBytes)
+{
+    uint8_t locked = heap_lock();
+    FreeListNode *block = compactResume; // Header of the block the walk is at
+    size_t movedBytes = 0;
+    size_t usedBudget = 0;
+
+    // Start a new pass at the bottom of the heap, also if trimming released the block the last step stopped at
+    if (block == NULL || (char *)block >= programBreak)
+    {
+        block = (FreeListNode *)heapStart;
+        compactPassMoved = 0;
+    }
+
+    while (block != NULL && (char *)block < programBreak && usedBudget < budgetBytes)
+    {
+        void *blockHeader = (void *)block + sizeof(FreeListNode) + block->length;
+        HmmHandle handle = BLOCK_IS_FREE(block) ? movable_handle_at(blockHeader) : 0;
+
+        if (handle == 0)
+        {
+            block = blockHeader;
+            usedBudget += COMPACT_VISIT_COST;
+            continue;
+        }
+
+        uint64_t holeLength = block->length;
+        uint64_t blockSpan = *(uint64_t *)blockHeader + sizeof(FreeListNode);
+        void *newHeader = (void *)block;
+        FreeListNode *newFree = (FreeListNode *)(newHeader + blockSpan);
+
+        // Slide the block (header included) down into the hole; free blocks are never adjacent, so none precedes it
+        remove_freelist_node(block);
+        memmove(newHeader, blockHeader, blockSpan);
+        ((FreeListNode *)newHeader)->next = NULL;
+        handleTable[handle].block = newHeader + sizeof(FreeListNode);
+
+        // The hole now sits above the block and holds stale bytes of the block that moved
+        mark_range_dirty(newHeader, blockSpan + holeLength + sizeof(FreeListNode));
+        newFree->length = holeLength;
+        newFree->prev = BLOCK_IN_USE;
+        newFree->next = NULL;
+
+        // Insertion merges the hole with a directly following free block, so the next move closes the whole gap
+        block = insert_block_into_freelist((void *)newFree + sizeof(FreeListNode));
+        movedBytes += blockSpan;
+        usedBudget += blockSpan;
+    }
+    compactPassMoved += movedBytes;
+
+    // Give any free space that reached the top of the heap back to the kernel
+    if (movedBytes > 0)
+    {
+        trim_program_break();
+    }
+
+    // A pass that reached the break without moving anything leaves nothing for the next one to do
+    compactResume = ((char *)block < programBreak) ? block : NULL;
+    if (compactResume == NULL && compactPassMoved == 0)
+    {
+        usedBudget = 0;
+    }
+
+    heap_unlock(locked);
+    return usedBudget;
+}
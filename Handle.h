@@ -0,0 +1,24 @@
+#ifndef HANDLE
+#define HANDLE
+
+#define HANDLE_MAX 65536                  /* Maximum number of live handles */
+#define HANDLE_MAGIC 0x484d4d48ULL        /* "HMMH", stored in the upper half of a handle block's tag */
+#define COMPACT_VISIT_COST 64             /* Budget bytes charged by HmmCompact for each block it looks at */
+
+// A handle names a relocatable block. 0 is never a valid handle.
+typedef uint32_t HmmHandle;
+
+// Define the HandleEntry structure: where a handle's block currently lives and whether it may move
+typedef struct HandleEntry {
+    void *block;        // User pointer of the underlying HmmAlloc block, NULL if the entry is unused
+    uint32_t lockCount; // Number of outstanding HmmHandleLock calls, the block only moves while this is 0
+    uint32_t nextFree;  // Next unused entry when this entry is on the unused list
+} HandleEntry;
+
+// Function declarations
+HmmHandle HmmHandleAlloc(size_t size);
+void HmmHandleFree(HmmHandle handle);
+void *HmmHandleLock(HmmHandle handle);
+void HmmHandleUnlock(HmmHandle handle);
+size_t HmmCompact(size_t budgetBytes);
+#endif
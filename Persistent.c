@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "heap.h"
+#include "FreeList.h"
+#include "Persistent.h"
+#include "Reclaim.h"
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+extern FreeListNode *FreeListHead;
+extern char *programBreak;
+
+// Header of the open heap file, NULL when no persistent heap is open
+PersistentHeader *persistentHeader = NULL;
+
+// Region the program break functions use while working on the persistent heap
+HeapRegion persistentRegion;
+
+// Process heap state saved while the persistent heap is swapped in
+FreeListNode *savedFreeListHead = NULL;
+FreeBinIndex *savedFreeBinIndex = NULL;
+char *savedProgramBreak = NULL;
+
+// Whether the heap lock was taken while the persistent heap is swapped in
+uint8_t persistentLocked = 0;
+
+/**
+ * @brief Computes the checksum of every header field before the checksum itself (FNV-1a).
+ */
+static uint64_t header_checksum(PersistentHeader *header)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const uint8_t *bytes = (const uint8_t *)header;
+    size_t i = 0;
+
+    for (i = 0; i < offsetof(PersistentHeader, checksum); i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/**
+ * @brief Checks that the heap file is internally consistent before it is used.
+ *
+ * Verifies the header checksum and bounds, then walks every block from the start of the heap to the break:
+ * each length must be a multiple of 8, large enough for bin links and end at or before the break, no two free
+ * blocks may be adjacent, and a block that is not free must name the free block before it, or none. Finally
+ * it walks the free list: every node must link back to its predecessor and be one of the free blocks found by
+ * the walk, and the list must hold all of them. The list walk stops after that many nodes, so it terminates on
+ * a corrupted list.
+ *
+ * @param header The mapped header.
+ * @return int 0 if the heap is consistent, -1 otherwise.
+ */
+static int validate_persistent_heap(PersistentHeader *header)
+{
+    char *heapStart = (char *)header + PERSISTENT_HEADER_SIZE;
+    char *heapEnd = (char *)header + header->breakOffset;
+    FreeListNode *block = (FreeListNode *)heapStart;
+    FreeListNode *previousBlock = NULL;
+    FreeListNode *node = header->freeListHead;
+    FreeListNode *previous = NULL;
+    FreeListNode *following = NULL;
+    uint64_t freeBlocks = 0;
+    uint64_t listedBlocks = 0;
+
+    if (header->checksum != header_checksum(header))
+    {
+        return -1;
+    }
+    if (header->breakOffset < PERSISTENT_HEADER_SIZE || header->breakOffset > header->highWaterOffset ||
+        header->highWaterOffset > header->capacity)
+    {
+        return -1;
+    }
+    if (header->root != NULL && ((char *)header->root < heapStart || (char *)header->root >= heapEnd))
+    {
+        return -1;
+    }
+
+    // Every block, in address order
+    while ((char *)block < heapEnd)
+    {
+        if ((uint64_t)(heapEnd - (char *)block) < sizeof(FreeListNode) || block->length < FREE_NODE_MIN_LENGTH ||
+            (block->length & 7) != 0 || block->length > (uint64_t)(heapEnd - (char *)block - sizeof(FreeListNode)))
+        {
+            return -1;
+        }
+        if (BLOCK_IS_FREE(block))
+        {
+            if (previousBlock != NULL && BLOCK_IS_FREE(previousBlock))
+            {
+                return -1;
+            }
+            freeBlocks++;
+        }
+        else if (block->next != ((previousBlock != NULL && BLOCK_IS_FREE(previousBlock)) ? previousBlock : NULL))
+        {
+            return -1;
+        }
+        previousBlock = block;
+        block = (FreeListNode *)((char *)block + sizeof(FreeListNode) + block->length);
+    }
+
+    // The free list must hold exactly the free blocks. A node is a block if the block after it names it, or it is
+    // the last block, since the walk above checked those tags.
+    while (node != NULL)
+    {
+        if (listedBlocks++ == freeBlocks)
+        {
+            return -1;
+        }
+        if ((char *)node < heapStart || (char *)node + sizeof(FreeListNode) > heapEnd || ((uintptr_t)node & 7) != 0 ||
+            node->prev != previous || node->length > (uint64_t)(heapEnd - (char *)node - sizeof(FreeListNode)))
+        {
+            return -1;
+        }
+        following = (FreeListNode *)((char *)node + sizeof(FreeListNode) + node->length);
+        if ((char *)following == heapEnd)
+        {
+            if (node != previousBlock)
+            {
+                return -1;
+            }
+        }
+        else if ((char *)following + sizeof(FreeListNode) > heapEnd || BLOCK_IS_FREE(following) ||
+                 following->next != node)
+        {
+            return -1;
+        }
+        previous = node;
+        node = node->next;
+    }
+    if (listedBlocks != freeBlocks)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Rebuilds the size-class bins of the heap file from its free list.
+ *
+ * The bins are not covered by the checksum, so they are never trusted across opens: the free list has just
+ * been validated and the bins are derived from it again.
+ *
+ * @param header The mapped header.
+ */
+static void rebuild_persistent_bins(PersistentHeader *header)
+{
+    FreeBinIndex *processIndex = freeBinIndex;
+    FreeListNode *node = header->freeListHead;
+    char *heapEnd = (char *)header + header->breakOffset;
+
+    memset(&header->freeBins, 0, sizeof(header->freeBins));
+    freeBinIndex = &header->freeBins;
+    while (node != NULL)
+    {
+        bin_insert(node);
+        if ((char *)node + sizeof(FreeListNode) + node->length == heapEnd)
+        {
+            header->freeBins.tail = node;
+        }
+        node = node->next;
+    }
+    freeBinIndex = processIndex;
+}
+
+/**
+ * @brief Makes the allocator operate on the persistent heap instead of the process heap.
+ *
+ * Holds the heap lock until leave_persistent_heap, so the reclaim thread never sees the swapped-in state.
+ */
+static void enter_persistent_heap(void)
+{
+    persistentLocked = heap_lock();
+    savedFreeListHead = FreeListHead;
+    savedFreeBinIndex = freeBinIndex;
+    savedProgramBreak = (programBreak != NULL) ? programBreak : (char *)sbrk(0);
+
+    persistentRegion.current = (char *)persistentHeader + persistentHeader->breakOffset;
+    persistentRegion.highWater = (char *)persistentHeader + persistentHeader->highWaterOffset;
+    FreeListHead = persistentHeader->freeListHead;
+    freeBinIndex = &persistentHeader->freeBins;
+    programBreak = persistentRegion.current;
+    activeRegion = &persistentRegion;
+}
+
+/**
+ * @brief Writes the allocator state back into the file header and switches back to the process heap.
+ *
+ * The header is updated and re-checksummed after every operation, so a crash between operations leaves a
+ * consistent file and a crash in the middle of one is caught by the checks at the next open.
+ */
+static void leave_persistent_heap(void)
+{
+    persistentHeader->freeListHead = FreeListHead;
+    persistentHeader->breakOffset = persistentRegion.current - (char *)persistentHeader;
+    persistentHeader->highWaterOffset = persistentRegion.highWater - (char *)persistentHeader;
+    persistentHeader->checksum = header_checksum(persistentHeader);
+
+    FreeListHead = savedFreeListHead;
+    freeBinIndex = savedFreeBinIndex;
+    programBreak = savedProgramBreak;
+    activeRegion = NULL;
+    heap_unlock(persistentLocked);
+}
+
+/**
+ * @brief Opens or creates a heap stored in a memory-mapped file.
+ *
+ * A new file is created with `capacity` bytes and mapped at `baseAddress` (or wherever the kernel chooses if
+ * it is NULL). An existing file is mapped at the address recorded in it, because free list nodes and block
+ * pointers are stored as raw addresses; opening fails if that address is not available. The header, every
+ * block and the free list are checked before the heap is used. Only one persistent heap can be open at a time.
+ *
+ * @param path Path of the heap file.
+ * @param capacity Size of a new heap file in bytes. Ignored when the file already exists.
+ * @param baseAddress Address to map a new heap file at, or NULL.
+ * @return int 0 if the heap was created or was closed cleanly, 1 if it was not closed cleanly but passed
+ *             the consistency checks, -1 on failure.
+ */
+int HmmPersistentOpen(const char *path, size_t capacity, void *baseAddress)
+{
+    PersistentHeader fileHeader;
+    PersistentHeader *header = NULL;
+    struct stat fileStat;
+    uint8_t locked = 0;
+    int result = 0;
+    int fd = -1;
+
+    if (persistentHeader != NULL)
+    {
+        return -1;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || fstat(fd, &fileStat) != 0)
+    {
+        goto fail;
+    }
+
+    if (fileStat.st_size == 0)
+    {
+        // New heap file: size it and lay down an empty header
+        capacity = (capacity + PERSISTENT_HEADER_SIZE - 1) & ~((size_t)PERSISTENT_HEADER_SIZE - 1);
+        if (capacity <= PERSISTENT_HEADER_SIZE || ftruncate(fd, capacity) != 0)
+        {
+            goto fail;
+        }
+
+        header = mmap(baseAddress, capacity, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | (baseAddress != NULL ? MAP_FIXED_NOREPLACE : 0), fd, 0);
+        if (header == MAP_FAILED || (baseAddress != NULL && (void *)header != baseAddress))
+        {
+            goto fail_mapped;
+        }
+
+        header->magic = PERSISTENT_MAGIC;
+        header->version = PERSISTENT_VERSION;
+        header->headerSize = sizeof(PersistentHeader);
+        header->baseAddress = header;
+        header->capacity = capacity;
+        header->breakOffset = PERSISTENT_HEADER_SIZE;
+        header->highWaterOffset = PERSISTENT_HEADER_SIZE;
+        header->freeListHead = NULL;
+        header->root = NULL;
+        header->openCount = 0;
+    }
+    else
+    {
+        // Existing heap file: check the header before trusting anything in it
+        if (pread(fd, &fileHeader, sizeof(fileHeader), 0) != sizeof(fileHeader) ||
+            fileHeader.magic != PERSISTENT_MAGIC || fileHeader.version != PERSISTENT_VERSION ||
+            fileHeader.headerSize != sizeof(PersistentHeader) || fileHeader.capacity != (uint64_t)fileStat.st_size)
+        {
+            goto fail;
+        }
+
+        capacity = fileHeader.capacity;
+        header = mmap(fileHeader.baseAddress, capacity, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+        if (header == MAP_FAILED || (void *)header != fileHeader.baseAddress)
+        {
+            goto fail_mapped;
+        }
+        if (validate_persistent_heap(header) != 0)
+        {
+            goto fail_mapped;
+        }
+
+        // A heap that was never closed survived a crash; report that it was recovered
+        result = (header->openCount != 0) ? 1 : 0;
+    }
+
+    close(fd);
+
+    locked = heap_lock();
+    rebuild_persistent_bins(header);
+    header->openCount = 1;
+    header->checksum = header_checksum(header);
+
+    persistentRegion.base = (char *)header + PERSISTENT_HEADER_SIZE;
+    persistentRegion.limit = (char *)header + capacity;
+    persistentHeader = header;
+
+    // Untouched space at the end of the file is still zero
+    mark_range_zeroed((char *)header + header->highWaterOffset, capacity - header->highWaterOffset);
+    heap_unlock(locked);
+
+    return result;
+
+fail_mapped:
+    if (header != MAP_FAILED)
+    {
+        munmap(header, capacity);
+    }
+fail:
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    return -1;
+}
+
+/**
+ * @brief Flushes the persistent heap to disk.
+ *
+ * @return int 0 on success, -1 if no heap is open or msync failed.
+ */
+int HmmPersistentSync(void)
+{
+    if (persistentHeader == NULL)
+    {
+        return -1;
+    }
+
+    return msync(persistentHeader, persistentHeader->capacity, MS_SYNC);
+}
+
+/**
+ * @brief Marks the persistent heap as cleanly closed, flushes it and unmaps it.
+ *
+ * Pointers into the heap are invalid after this call.
+ *
+ * @return int 0 on success, -1 if no heap is open or flushing failed.
+ */
+int HmmPersistentClose(void)
+{
+    PersistentHeader *header = persistentHeader;
+    uint64_t capacity = 0;
+    uint8_t locked = 0;
+    int result = 0;
+
+    if (header == NULL)
+    {
+        return -1;
+    }
+
+    header->openCount = 0;
+    header->checksum = header_checksum(header);
+    result = HmmPersistentSync();
+
+    // Forget the zero ranges inside the mapping before it goes away
+    capacity = header->capacity;
+    locked = heap_lock();
+    mark_range_dirty(header, capacity);
+    heap_unlock(locked);
+    persistentHeader = NULL;
+    munmap(header, capacity);
+
+    return result;
+}
+
+/**
+ * @brief Allocates a block in the persistent heap.
+ *
+ * @param size Size of the block in bytes.
+ * @return void* Pointer to the block, or NULL if no heap is open or the heap file is full.
+ */
+void *HmmPersistentAlloc(size_t size)
+{
+    void *ptr = NULL;
+
+    if (persistentHeader == NULL)
+    {
+        return NULL;
+    }
+
+    enter_persistent_heap();
+    ptr = HmmAlloc(size);
+    leave_persistent_heap();
+
+    return ptr;
+}
+
+/**
+ * @brief Allocates a zero-initialised array in the persistent heap.
+ *
+ * @param nmemb Number of elements.
+ * @param size Size of each element in bytes.
+ * @return void* Pointer to the block, or NULL on failure.
+ */
+void *HmmPersistentCalloc(size_t nmemb, size_t size)
+{
+    void *ptr = NULL;
+
+    if (persistentHeader == NULL)
+    {
+        return NULL;
+    }
+
+    enter_persistent_heap();
+    ptr = HmmCalloc(nmemb, size);
+    leave_persistent_heap();
+
+    return ptr;
+}
+
+/**
+ * @brief Resizes a block of the persistent heap.
+ *
+ * @param ptr Block previously returned by the persistent heap, or NULL to allocate a new one.
+ * @param size New size in bytes.
+ * @return void* Pointer to the resized block, or NULL on failure.
+ */
+void *HmmPersistentRealloc(void *ptr, size_t size)
+{
+    void *newPtr = NULL;
+
+    if (ptr == NULL)
+    {
+        return HmmPersistentAlloc(size);
+    }
+    if (persistentHeader == NULL)
+    {
+        return NULL;
+    }
+
+    enter_persistent_heap();
+    newPtr = HmmRealloc(ptr, size);
+    leave_persistent_heap();
+
+    return newPtr;
+}
+
+/**
+ * @brief Frees a block of the persistent heap.
+ *
+ * @param ptr Block previously returned by the persistent heap. NULL is ignored.
+ */
+void HmmPersistentFree(void *ptr)
+{
+    if (ptr == NULL || persistentHeader == NULL)
+    {
+        return;
+    }
+
+    enter_persistent_heap();
+    HmmFree(ptr);
+    leave_persistent_heap();
+}
+
+/**
+ * @brief Stores the application's root pointer in the heap file, to be found again after reopening.
+ *
+ * @param root Pointer into the persistent heap, typically the top of an index, or NULL.
+ */
+void HmmPersistentSetRoot(void *root)
+{
+    if (persistentHeader == NULL)
+    {
+        return;
+    }
+
+    persistentHeader->root = root;
+    persistentHeader->checksum = header_checksum(persistentHeader);
+}
+
+/**
+ * @brief Returns the root pointer stored in the heap file.
+ *
+ * @return void* The root pointer, or NULL if none was set or no heap is open.
+ */
+void *HmmPersistentGetRoot(void)
+{
+    if (persistentHeader == NULL)
+    {
+        return NULL;
+    }
+
+    return persistentHeader->root;
+}
@@ -0,0 +1,34 @@
+#ifndef PERSISTENT
+#define PERSISTENT
+
+#define PERSISTENT_MAGIC 0x50414548504d4d48ULL /* "HMMPHEAP" */
+#define PERSISTENT_VERSION 3
+#define PERSISTENT_HEADER_SIZE 4096            /* The heap starts one page into the file */
+
+// Define the PersistentHeader structure: allocator state stored at the start of the heap file
+typedef struct PersistentHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t headerSize;
+    void *baseAddress;           // Address the file is mapped at; block and node pointers are only valid there
+    uint64_t capacity;           // Size of the file and of the mapping
+    uint64_t breakOffset;        // End of the heap, as an offset from baseAddress
+    uint64_t highWaterOffset;    // Bytes from here to the end of the file have never been used
+    FreeListNode *freeListHead;  // FreeListHead of the heap in the file
+    void *root;                  // Application root pointer
+    uint64_t openCount;          // Non-zero while a process has the heap open
+    uint64_t checksum;           // Checksum of all fields above
+    FreeBinIndex freeBins;       // Size-class bins of the free list, rebuilt from the list on every open
+} PersistentHeader;
+
+// Function declarations
+int HmmPersistentOpen(const char *path, size_t capacity, void *baseAddress);
+int HmmPersistentClose(void);
+int HmmPersistentSync(void);
+void *HmmPersistentAlloc(size_t size);
+void *HmmPersistentCalloc(size_t nmemb, size_t size);
+void *HmmPersistentRealloc(void *ptr, size_t size);
+void HmmPersistentFree(void *ptr);
+void HmmPersistentSetRoot(void *root);
+void *HmmPersistentGetRoot(void);
+#endif
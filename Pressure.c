@@ -0,0 +1,345 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include "heap.h"
+#include "FreeList.h"
+#include "Pressure.h"
+#include "Reclaim.h"
+
+// Currently watched pressure source and the resulting state
+uint8_t pressureSource = PRESSURE_SOURCE_NONE;
+uint8_t memoryPressure = 0;
+
+// cgroup v2 files and the usage thresholds, in percent of memory.max, to enter and leave pressure
+char cgroupCurrentPath[PRESSURE_PATH_MAX];
+char cgroupMaxPath[PRESSURE_PATH_MAX];
+uint32_t pressureHighPercent = 90;
+uint32_t pressureLowPercent = 80;
+
+// PSI trigger file descriptor, its window, and when it last fired
+int psiFd = -1;
+uint64_t psiWindowNs = 0;
+uint64_t psiLastEventNs = 0;
+
+// Application-supplied pressure callback
+HmmPressureCallback pressureCallback = NULL;
+void *pressureContext = NULL;
+
+// Rate limiting of checks made from HmmFree and HmmAlloc
+uint64_t pressureIntervalNs = PRESSURE_DEFAULT_INTERVAL_MS * 1000000ULL;
+uint64_t lastPressureCheckNs = 0;
+uint32_t freesUntilPressureCheck = PRESSURE_CHECK_FREES;
+
+static uint64_t pressure_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/**
+ * @brief Reads a cgroup v2 memory file holding either a byte count or "max".
+ *
+ * @param path Path of the file.
+ * @param value Receives the value, UINT64_MAX for "max".
+ * @return int 0 on success, -1 if the file cannot be read or parsed.
+ */
+static int read_cgroup_value(const char *path, uint64_t *value)
+{
+    char buffer[64];
+    ssize_t length = 0;
+    ssize_t i = 0;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        return -1;
+    }
+    length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0)
+    {
+        return -1;
+    }
+    buffer[length] = '\0';
+
+    if (strncmp(buffer, "max", 3) == 0)
+    {
+        *value = UINT64_MAX;
+        return 0;
+    }
+    if (buffer[0] < '0' || buffer[0] > '9')
+    {
+        return -1;
+    }
+
+    *value = 0;
+    for (i = 0; i < length && buffer[i] >= '0' && buffer[i] <= '9'; i++)
+    {
+        *value = *value * 10 + (buffer[i] - '0');
+    }
+    return 0;
+}
+
+/**
+ * @brief Decides whether memory is under pressure right now, according to the watched source.
+ *
+ * The cgroup source uses hysteresis: pressure starts at the high threshold and only ends below the low one.
+ * The PSI source stays under pressure for one trigger window after the last event.
+ */
+static uint8_t evaluate_pressure(void)
+{
+    uint64_t current = 0;
+    uint64_t limit = 0;
+    struct pollfd psiPoll;
+
+    switch (pressureSource)
+    {
+    case PRESSURE_SOURCE_CGROUP:
+        if (read_cgroup_value(cgroupCurrentPath, &current) != 0 || read_cgroup_value(cgroupMaxPath, &limit) != 0 ||
+            limit == UINT64_MAX)
+        {
+            return 0;
+        }
+        if (memoryPressure)
+        {
+            return (current * 100 >= limit * pressureLowPercent) ? 1 : 0;
+        }
+        return (current * 100 >= limit * pressureHighPercent) ? 1 : 0;
+
+    case PRESSURE_SOURCE_PSI:
+        psiPoll.fd = psiFd;
+        psiPoll.events = POLLPRI;
+        psiPoll.revents = 0;
+        if (poll(&psiPoll, 1, 0) > 0 && (psiPoll.revents & POLLPRI))
+        {
+            psiLastEventNs = pressure_now_ns();
+            return 1;
+        }
+        return (memoryPressure && pressure_now_ns() - psiLastEventNs < psiWindowNs) ? 1 : 0;
+
+    case PRESSURE_SOURCE_CALLBACK:
+        return pressureCallback(pressureContext) ? 1 : 0;
+
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Watches cgroup v2 memory usage against the cgroup's limit.
+ *
+ * Memory is considered under pressure once memory.current reaches `highPercent` of memory.max, and stays
+ * so until it drops below `lowPercent`. The directory can point at any pair of files with the same format,
+ * which is how the behaviour is tested without a real cgroup.
+ *
+ * @param cgroupDir Directory holding memory.current and memory.max, or NULL for /sys/fs/cgroup.
+ * @param highPercent Usage in percent of the limit at which pressure starts, 0 for the default of 90.
+ * @param lowPercent Usage in percent of the limit below which pressure ends, 0 for the default of 80.
+ * @return int 0 on success, -1 if the files cannot be read.
+ */
+int HmmPressureWatchCgroup(const char *cgroupDir, uint32_t highPercent, uint32_t lowPercent)
+{
+    uint64_t value = 0;
+
+    if (cgroupDir == NULL)
+    {
+        cgroupDir = "/sys/fs/cgroup";
+    }
+
+    HmmPressureStop();
+    snprintf(cgroupCurrentPath, sizeof(cgroupCurrentPath), "%s/memory.current", cgroupDir);
+    snprintf(cgroupMaxPath, sizeof(cgroupMaxPath), "%s/memory.max", cgroupDir);
+    if (read_cgroup_value(cgroupCurrentPath, &value) != 0 || read_cgroup_value(cgroupMaxPath, &value) != 0)
+    {
+        return -1;
+    }
+
+    pressureHighPercent = (highPercent != 0) ? highPercent : 90;
+    pressureLowPercent = (lowPercent != 0 && lowPercent <= pressureHighPercent) ? lowPercent : pressureHighPercent * 8 / 9;
+    pressureSource = PRESSURE_SOURCE_CGROUP;
+    return 0;
+}
+
+/**
+ * @brief Watches memory pressure through a PSI trigger.
+ *
+ * Registers a trigger that fires when tasks stall on memory for at least `stallUs` within `windowUs`.
+ *
+ * @param psiPath PSI file, or NULL for /proc/pressure/memory.
+ * @param stallUs Stall time in microseconds that fires the trigger.
+ * @param windowUs Trigger window in microseconds (the kernel accepts 500 ms to 10 s).
+ * @return int 0 on success, -1 if PSI is not available.
+ */
+int HmmPressureWatchPsi(const char *psiPath, uint64_t stallUs, uint64_t windowUs)
+{
+    char trigger[64];
+    int length = 0;
+
+    if (psiPath == NULL)
+    {
+        psiPath = "/proc/pressure/memory";
+    }
+
+    HmmPressureStop();
+    psiFd = open(psiPath, O_RDWR | O_NONBLOCK);
+    if (psiFd < 0)
+    {
+        return -1;
+    }
+
+    length = snprintf(trigger, sizeof(trigger), "some %llu %llu", (unsigned long long)stallUs,
+                      (unsigned long long)windowUs);
+    if (write(psiFd, trigger, length + 1) < 0)
+    {
+        close(psiFd);
+        psiFd = -1;
+        return -1;
+    }
+
+    psiWindowNs = windowUs * 1000;
+    pressureSource = PRESSURE_SOURCE_PSI;
+    return 0;
+}
+
+/**
+ * @brief Lets the application decide when memory is under pressure.
+ *
+ * @param callback Function returning non-zero while memory should be released aggressively.
+ * @param context Passed to the callback unchanged.
+ */
+void HmmPressureWatchCallback(HmmPressureCallback callback, void *context)
+{
+    HmmPressureStop();
+    if (callback == NULL)
+    {
+        return;
+    }
+
+    pressureCallback = callback;
+    pressureContext = context;
+    pressureSource = PRESSURE_SOURCE_CALLBACK;
+}
+
+/**
+ * @brief Stops watching memory pressure and returns to the normal trimming behaviour.
+ */
+void HmmPressureStop(void)
+{
+    if (psiFd >= 0)
+    {
+        close(psiFd);
+        psiFd = -1;
+    }
+
+    pressureSource = PRESSURE_SOURCE_NONE;
+    pressureCallback = NULL;
+    pressureContext = NULL;
+    memoryPressure = 0;
+}
+
+/**
+ * @brief Sets the minimum time between two pressure checks made from HmmFree and HmmAlloc.
+ *
+ * @param intervalMs Interval in milliseconds, 0 to check every PRESSURE_CHECK_FREES frees.
+ */
+void HmmPressureSetInterval(uint64_t intervalMs)
+{
+    pressureIntervalNs = intervalMs * 1000000ULL;
+}
+
+/**
+ * @brief Evaluates memory pressure now and releases free memory if it is high.
+ *
+ * While the reclaim thread runs, the release is left to it, and only asked for when pressure starts.
+ *
+ * @return uint8_t 1 if memory is under pressure, 0 otherwise.
+ */
+uint8_t HmmPressureCheck(void)
+{
+    uint8_t wasUnderPressure = memoryPressure;
+
+    memoryPressure = evaluate_pressure();
+    lastPressureCheckNs = pressure_now_ns();
+
+    if (memoryPressure && reclaimActive)
+    {
+        if (!wasUnderPressure)
+        {
+            reclaim_request_release();
+        }
+    }
+    else if (memoryPressure)
+    {
+        HmmReleaseFreeMemory();
+    }
+
+    return memoryPressure;
+}
+
+/**
+ * @brief Gives as much free memory back to the kernel as possible.
+ *
+ * Releases the whole free run at the top of the heap and then the free pages inside the heap with
+ * MADV_DONTNEED. Only applies to the process heap, not to a mapped heap.
+ *
+ * @return size_t Number of bytes released.
+ */
+size_t HmmReleaseFreeMemory(void)
+{
+    size_t releasedBytes = 0;
+    uint8_t locked = 0;
+
+    if (activeRegion != NULL)
+    {
+        return 0;
+    }
+
+    locked = heap_lock();
+    releasedBytes = release_free_top() + release_free_pages();
+    heap_unlock(locked);
+
+    return releasedBytes;
+}
+
+/**
+ * @brief Cheap periodic hook called from HmmFree while a pressure source is watched.
+ *
+ * Only looks at the clock every PRESSURE_CHECK_FREES frees, and only reads the pressure source once the
+ * check interval has passed.
+ */
+void pressure_poll(void)
+{
+    if (--freesUntilPressureCheck != 0)
+    {
+        return;
+    }
+    freesUntilPressureCheck = PRESSURE_CHECK_FREES;
+
+    if (pressure_now_ns() - lastPressureCheckNs < pressureIntervalNs)
+    {
+        return;
+    }
+
+    HmmPressureCheck();
+}
+
+/**
+ * @brief Hook called from HmmAlloc after it grew the heap while a pressure source is watched.
+ *
+ * Lets a workload that mostly allocates notice pressure too. Growing the heap already costs a system call, so
+ * the clock is read every time; the pressure source is still only read once the check interval has passed.
+ */
+void pressure_poll_growth(void)
+{
+    if (pressure_now_ns() - lastPressureCheckNs < pressureIntervalNs)
+    {
+        return;
+    }
+
+    HmmPressureCheck();
+}
@@ -0,0 +1,33 @@
+#ifndef PRESSURE
+#define PRESSURE
+
+// Where memory pressure is read from
+#define PRESSURE_SOURCE_NONE 0     /* Pressure is not watched */
+#define PRESSURE_SOURCE_CGROUP 1   /* memory.current compared against memory.max */
+#define PRESSURE_SOURCE_PSI 2      /* PSI trigger on /proc/pressure/memory */
+#define PRESSURE_SOURCE_CALLBACK 3 /* Application-supplied callback */
+
+#define PRESSURE_CHECK_FREES 64            /* HmmFree calls between two looks at the clock */
+#define PRESSURE_DEFAULT_INTERVAL_MS 100   /* Minimum time between two pressure checks */
+#define PRESSURE_PATH_MAX 256
+
+// Returns non-zero while the application considers memory to be under pressure
+typedef int (*HmmPressureCallback)(void *context);
+
+// Currently watched pressure source, PRESSURE_SOURCE_NONE when off. Checked by HmmFree and HmmAlloc.
+extern uint8_t pressureSource;
+
+// Non-zero while memory is under pressure
+extern uint8_t memoryPressure;
+
+// Function declarations
+int HmmPressureWatchCgroup(const char *cgroupDir, uint32_t highPercent, uint32_t lowPercent);
+int HmmPressureWatchPsi(const char *psiPath, uint64_t stallUs, uint64_t windowUs);
+void HmmPressureWatchCallback(HmmPressureCallback callback, void *context);
+void HmmPressureStop(void);
+void HmmPressureSetInterval(uint64_t intervalMs);
+uint8_t HmmPressureCheck(void);
+size_t HmmReleaseFreeMemory(void);
+void pressure_poll(void);
+void pressure_poll_growth(void);
+#endif
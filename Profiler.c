@@ -0,0 +1,581 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <execinfo.h>
+#include "Profiler.h"
+
+#define PROFILE_SKIP_FRAMES 2 /* profile_record_alloc and the malloc/calloc/realloc wrapper */
+
+// Sampling interval in bytes, 0 when profiling is off
+uint64_t profileSampleRate = 0;
+
+// Bytes left before the next sample is taken, and the interval it was drawn from
+int64_t bytesUntilSample = 0;
+uint64_t currentInterval = 0;
+
+// State of the xorshift generator used to draw sampling intervals
+uint64_t randomState = 88172645463325252ULL;
+
+// Set while the profiler itself is running, so allocations it triggers are not sampled
+uint8_t profileBusy = 0;
+
+// Preallocated tables, so taking a sample never has to allocate
+ProfileStack profileStacks[PROFILE_MAX_STACKS];
+ProfileSample profileSamples[PROFILE_MAX_SAMPLES];
+uint32_t profileSampleCount = 0;
+
+// Prefix of the files written by profile_dump_file, and how many it has written. Set from HMM_PROFILE_FILE.
+char profileFilePrefix[PROFILE_PREFIX_MAX] = "hmm";
+uint32_t profileFileSequence = 0;
+
+// Whether the profile is written to a file when the process exits, set when HMM_PROFILE started the profiler
+uint8_t profileDumpAtExit = 0;
+
+// Define the DumpBuffer structure: output buffer used to write a profile without stdio
+typedef struct DumpBuffer {
+    int fd;
+    int failed;
+    uint32_t length;
+    char data[4096];
+} DumpBuffer;
+
+/**
+ * @brief Approximates log2(x) for x in (0, 1] from the IEEE-754 exponent and a quadratic on the mantissa.
+ */
+static double fast_log2(double x)
+{
+    union { double value; uint64_t bits; } number = { x };
+    int64_t exponent = (int64_t)((number.bits >> 52) & 0x7ff) - 1023;
+    double mantissa;
+
+    number.bits = (number.bits & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    mantissa = number.value; // In [1, 2)
+
+    return exponent + (-0.34484843 * mantissa + 2.02466578) * mantissa - 0.67487759;
+}
+
+/**
+ * @brief Draws the number of bytes until the next sample from an exponential distribution.
+ *
+ * Exponentially distributed gaps make the samples a Poisson process over allocated bytes, so every byte
+ * has the same chance of being sampled regardless of the allocation pattern.
+ */
+static uint64_t next_sample_interval(void)
+{
+    double uniform;
+    double interval;
+
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 7;
+    randomState ^= randomState << 17;
+
+    // Uniform value in (0, 1], never zero so the logarithm stays finite
+    uniform = (double)((randomState >> 11) + 1) * (1.0 / 9007199254740992.0);
+    interval = -fast_log2(uniform) * 0.6931471805599453 * (double)profileSampleRate;
+
+    return (interval < 1.0) ? 1 : (uint64_t)interval;
+}
+
+static uint64_t hash_pointer(void *ptr)
+{
+    uint64_t value = (uint64_t)(uintptr_t)ptr;
+    value ^= value >> 33;
+    value *= 0xff51afd7ed558ccdULL;
+    value ^= value >> 33;
+    return value;
+}
+
+/**
+ * @brief Finds the stack entry for a backtrace, creating it if this stack has not been seen yet.
+ *
+ * @return uint32_t Index of the entry in profileStacks, or PROFILE_MAX_STACKS if the table is full.
+ */
+static uint32_t find_or_insert_stack(void **frames, uint32_t depth)
+{
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a offset basis
+    uint32_t i = 0;
+    uint32_t slot = 0;
+
+    for (i = 0; i < depth; i++)
+    {
+        hash ^= (uint64_t)(uintptr_t)frames[i];
+        hash *= 1099511628211ULL;
+    }
+
+    slot = hash & (PROFILE_MAX_STACKS - 1);
+    for (i = 0; i < PROFILE_MAX_STACKS; i++)
+    {
+        ProfileStack *stack = &profileStacks[slot];
+
+        if (stack->depth == 0)
+        {
+            // Empty slot, record the new stack here
+            stack->hash = hash;
+            stack->depth = depth;
+            memcpy(stack->frames, frames, depth * sizeof(void *));
+            return slot;
+        }
+        if (stack->hash == hash && stack->depth == depth && memcmp(stack->frames, frames, depth * sizeof(void *)) == 0)
+        {
+            return slot;
+        }
+        slot = (slot + 1) & (PROFILE_MAX_STACKS - 1);
+    }
+
+    return PROFILE_MAX_STACKS;
+}
+
+/**
+ * @brief Starts sampling allocations, roughly one sample every `sampleRate` bytes.
+ *
+ * Clears any previous profile. A sample rate of 0 stops profiling.
+ *
+ * @param sampleRate Mean number of allocated bytes between two samples.
+ */
+void HmmProfileStart(uint64_t sampleRate)
+{
+    void *frames[1];
+
+    if (sampleRate == 0)
+    {
+        HmmProfileStop();
+        return;
+    }
+
+    // The first backtrace() call loads the unwinder, which allocates. Do it now rather than in a sample.
+    profileBusy = 1;
+    backtrace(frames, 1);
+    profileBusy = 0;
+
+    memset(profileStacks, 0, sizeof(profileStacks));
+    memset(profileSamples, 0, sizeof(profileSamples));
+    profileSampleCount = 0;
+
+    randomState ^= (uint64_t)(uintptr_t)frames ^ ((uint64_t)getpid() << 32);
+    profileSampleRate = sampleRate;
+    currentInterval = next_sample_interval();
+    bytesUntilSample = (int64_t)currentInterval;
+}
+
+/**
+ * @brief Stops sampling. The collected profile is kept and can still be dumped.
+ */
+void HmmProfileStop(void)
+{
+    profileSampleRate = 0;
+}
+
+/**
+ * @brief Accounts an allocation and takes a sample when the byte countdown runs out.
+ *
+ * A sample carries a weight equal to the bytes allocated since the previous sample, which makes the
+ * per-stack totals unbiased estimates of the real allocated bytes. The backtrace and bookkeeping go into
+ * the preallocated tables; a sample is dropped if either table is full.
+ *
+ * @param ptr Pointer returned by the allocator.
+ * @param size Requested size in bytes.
+ */
+void profile_record_alloc(void *ptr, uint64_t size)
+{
+    void *frames[PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES];
+    int depth = 0;
+    uint64_t weight = 0;
+    uint64_t count = 0;
+    uint32_t stackIndex = 0;
+    uint32_t slot = 0;
+
+    if (ptr == NULL || profileBusy)
+    {
+        return;
+    }
+
+    bytesUntilSample -= (int64_t)size;
+    if (bytesUntilSample > 0)
+    {
+        return;
+    }
+
+    profileBusy = 1;
+
+    // Weight is everything allocated since the last sample, count is how many objects of this size that is
+    weight = currentInterval - bytesUntilSample;
+    count = (size > 0) ? weight / size : weight;
+    if (count == 0)
+    {
+        count = 1;
+    }
+
+    currentInterval = next_sample_interval();
+    bytesUntilSample = (int64_t)currentInterval;
+
+    depth = backtrace(frames, PROFILE_MAX_DEPTH + PROFILE_SKIP_FRAMES) - PROFILE_SKIP_FRAMES;
+    if (depth > 0 && profileSampleCount < PROFILE_MAX_SAMPLES / 2)
+    {
+        stackIndex = find_or_insert_stack(frames + PROFILE_SKIP_FRAMES, depth);
+        if (stackIndex < PROFILE_MAX_STACKS)
+        {
+            profileStacks[stackIndex].liveBytes += weight;
+            profileStacks[stackIndex].liveCount += count;
+            profileStacks[stackIndex].totalBytes += weight;
+            profileStacks[stackIndex].totalCount += count;
+
+            // Remember the sample so that freeing it can subtract its weight again
+            slot = hash_pointer(ptr) & (PROFILE_MAX_SAMPLES - 1);
+            while (profileSamples[slot].ptr != NULL)
+            {
+                slot = (slot + 1) & (PROFILE_MAX_SAMPLES - 1);
+            }
+            profileSamples[slot].ptr = ptr;
+            profileSamples[slot].stackIndex = stackIndex;
+            profileSamples[slot].weight = weight;
+            profileSamples[slot].count = count;
+            profileSampleCount++;
+        }
+    }
+
+    profileBusy = 0;
+}
+
+/**
+ * @brief Removes a sampled allocation from the live profile when it is freed.
+ *
+ * Pointers that were not sampled are not found in the table and are ignored. The slot is emptied with
+ * backward-shift deletion so lookups never need tombstones.
+ *
+ * @param ptr Pointer being freed.
+ */
+void profile_record_free(void *ptr)
+{
+    uint32_t slot = 0;
+    uint32_t next = 0;
+    uint32_t home = 0;
+
+    if (ptr == NULL || profileSampleCount == 0)
+    {
+        return;
+    }
+
+    slot = hash_pointer(ptr) & (PROFILE_MAX_SAMPLES - 1);
+    while (profileSamples[slot].ptr != ptr)
+    {
+        if (profileSamples[slot].ptr == NULL)
+        {
+            return; // Not a sampled allocation
+        }
+        slot = (slot + 1) & (PROFILE_MAX_SAMPLES - 1);
+    }
+
+    profileStacks[profileSamples[slot].stackIndex].liveBytes -= profileSamples[slot].weight;
+    profileStacks[profileSamples[slot].stackIndex].liveCount -= profileSamples[slot].count;
+    profileSampleCount--;
+
+    // Shift later entries of the probe sequence back into the hole
+    next = slot;
+    while (1)
+    {
+        next = (next + 1) & (PROFILE_MAX_SAMPLES - 1);
+        if (profileSamples[next].ptr == NULL)
+        {
+            profileSamples[slot].ptr = NULL;
+            break;
+        }
+
+        home = hash_pointer(profileSamples[next].ptr) & (PROFILE_MAX_SAMPLES - 1);
+        if ((slot <= next) ? (slot < home && home <= next) : (slot < home || home <= next))
+        {
+            continue; // Entry is still reachable from its home slot
+        }
+
+        profileSamples[slot] = profileSamples[next];
+        slot = next;
+    }
+}
+
+static void dump_flush(DumpBuffer *buffer)
+{
+    uint32_t written = 0;
+
+    while (written < buffer->length && !buffer->failed)
+    {
+        ssize_t result = write(buffer->fd, buffer->data + written, buffer->length - written);
+        if (result <= 0)
+        {
+            buffer->failed = 1;
+        }
+        else
+        {
+            written += result;
+        }
+    }
+    buffer->length = 0;
+}
+
+static void dump_text(DumpBuffer *buffer, const char *text, uint32_t length)
+{
+    uint32_t i = 0;
+
+    for (i = 0; i < length; i++)
+    {
+        if (buffer->length == sizeof(buffer->data))
+        {
+            dump_flush(buffer);
+        }
+        buffer->data[buffer->length++] = text[i];
+    }
+}
+
+static void dump_string(DumpBuffer *buffer, const char *text)
+{
+    dump_text(buffer, text, strlen(text));
+}
+
+static void dump_number(DumpBuffer *buffer, uint64_t value, uint32_t base)
+{
+    char digits[24];
+    uint32_t position = sizeof(digits);
+
+    do
+    {
+        digits[--position] = "0123456789abcdef"[value % base];
+        value /= base;
+    } while (value != 0);
+
+    if (base == 16)
+    {
+        dump_string(buffer, "0x");
+    }
+    dump_text(buffer, digits + position, sizeof(digits) - position);
+}
+
+/**
+ * @brief Writes the sampled heap profile to a file descriptor.
+ *
+ * HMM_PROFILE_PPROF writes the legacy pprof heap format followed by /proc/self/maps so that `pprof` can
+ * symbolize it. HMM_PROFILE_COLLAPSED writes one "outer;...;inner bytes" line per stack with live bytes,
+ * which flamegraph.pl accepts directly. Byte and object counts are estimates scaled up from the samples.
+ * Output is produced with write() only, so it is safe to call while the heap is in use.
+ *
+ * @param fd File descriptor to write to.
+ * @param format HMM_PROFILE_PPROF or HMM_PROFILE_COLLAPSED.
+ * @return int 0 on success, -1 if writing failed.
+ */
+int HmmProfileDump(int fd, uint8_t format)
+{
+    DumpBuffer buffer;
+    uint64_t liveBytes = 0, liveCount = 0, totalBytes = 0, totalCount = 0;
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    buffer.fd = fd;
+    buffer.failed = 0;
+    buffer.length = 0;
+
+    if (format == HMM_PROFILE_COLLAPSED)
+    {
+        for (i = 0; i < PROFILE_MAX_STACKS; i++)
+        {
+            if (profileStacks[i].depth == 0 || profileStacks[i].liveBytes == 0)
+            {
+                continue;
+            }
+            // Collapsed stacks list the outermost frame first
+            for (j = profileStacks[i].depth; j > 0; j--)
+            {
+                dump_number(&buffer, (uint64_t)(uintptr_t)profileStacks[i].frames[j - 1], 16);
+                dump_string(&buffer, (j > 1) ? ";" : " ");
+            }
+            dump_number(&buffer, profileStacks[i].liveBytes, 10);
+            dump_string(&buffer, "\n");
+        }
+    }
+    else
+    {
+        for (i = 0; i < PROFILE_MAX_STACKS; i++)
+        {
+            liveBytes += profileStacks[i].liveBytes;
+            liveCount += profileStacks[i].liveCount;
+            totalBytes += profileStacks[i].totalBytes;
+            totalCount += profileStacks[i].totalCount;
+        }
+
+        // Weights are already unsampled, so report a sampling rate of 1 to stop pprof scaling them again
+        dump_string(&buffer, "heap profile: ");
+        dump_number(&buffer, liveCount, 10);
+        dump_string(&buffer, ": ");
+        dump_number(&buffer, liveBytes, 10);
+        dump_string(&buffer, " [");
+        dump_number(&buffer, totalCount, 10);
+        dump_string(&buffer, ": ");
+        dump_number(&buffer, totalBytes, 10);
+        dump_string(&buffer, "] @ heap_v2/1\n");
+
+        for (i = 0; i < PROFILE_MAX_STACKS; i++)
+        {
+            if (profileStacks[i].depth == 0)
+            {
+                continue;
+            }
+            dump_number(&buffer, profileStacks[i].liveCount, 10);
+            dump_string(&buffer, ": ");
+            dump_number(&buffer, profileStacks[i].liveBytes, 10);
+            dump_string(&buffer, " [");
+            dump_number(&buffer, profileStacks[i].totalCount, 10);
+            dump_string(&buffer, ": ");
+            dump_number(&buffer, profileStacks[i].totalBytes, 10);
+            dump_string(&buffer, "] @");
+            for (j = 0; j < profileStacks[i].depth; j++)
+            {
+                dump_string(&buffer, " ");
+                dump_number(&buffer, (uint64_t)(uintptr_t)profileStacks[i].frames[j], 16);
+            }
+            dump_string(&buffer, "\n");
+        }
+
+        // Append the memory map so that addresses can be symbolized offline
+        dump_string(&buffer, "\nMAPPED_LIBRARIES:\n");
+        dump_flush(&buffer);
+        int mapsFd = open("/proc/self/maps", O_RDONLY);
+        if (mapsFd >= 0)
+        {
+            ssize_t result = 0;
+            while ((result = read(mapsFd, buffer.data, sizeof(buffer.data))) > 0)
+            {
+                buffer.length = result;
+                dump_flush(&buffer);
+            }
+            close(mapsFd);
+        }
+    }
+
+    dump_flush(&buffer);
+    return buffer.failed ? -1 : 0;
+}
+
+/**
+ * @brief Appends a decimal number, zero-padded to `width` digits, to a string being built in place.
+ *
+ * @return char* The end of the string.
+ */
+static char *append_number(char *end, uint64_t value, uint32_t width)
+{
+    char digits[20];
+    uint32_t count = 0;
+
+    do
+    {
+        digits[count++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (count < width)
+    {
+        digits[count++] = '0';
+    }
+    while (count > 0)
+    {
+        *end++ = digits[--count];
+    }
+
+    return end;
+}
+
+/**
+ * @brief Writes the profile in pprof format to the next file named "<prefix>.<pid>.<sequence>.heap".
+ *
+ * Only uses getpid, open, write, read and close, and formats the name by hand, so it can be called from a signal
+ * handler.
+ *
+ * @return int 0 on success, -1 if the file cannot be written.
+ */
+int profile_dump_file(void)
+{
+    char path[PROFILE_PREFIX_MAX + 48];
+    char *end = path;
+    uint32_t sequence = __atomic_fetch_add(&profileFileSequence, 1, __ATOMIC_RELAXED);
+    int fd = -1;
+    int result = 0;
+
+    end = stpcpy(end, profileFilePrefix);
+    *end++ = '.';
+    end = append_number(end, (uint64_t)getpid(), 1);
+    *end++ = '.';
+    end = append_number(end, sequence, 4);
+    strcpy(end, ".heap");
+
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    result = HmmProfileDump(fd, HMM_PROFILE_PPROF);
+    if (close(fd) != 0)
+    {
+        result = -1;
+    }
+
+    return result;
+}
+
+/**
+ * @brief Signal handler installed for HMM_PROFILE_SIGNAL, which writes the profile on demand.
+ */
+static void profile_signal_handler(int signalNumber)
+{
+    int savedErrno = errno;
+
+    (void)signalNumber;
+    profile_dump_file();
+    errno = savedErrno;
+}
+
+/**
+ * @brief Starts profiling a program that does not call HmmProfileStart itself, such as one run with LD_PRELOAD.
+ *
+ * Called by heap_init for HMM_PROFILE. The profile is written to a file when the process exits, and also each time
+ * the process receives `signalNumber`, if given. Files are named after `prefix`, "hmm" if it is NULL or too long.
+ *
+ * @param sampleRate Mean number of allocated bytes between two samples.
+ * @param prefix Value of HMM_PROFILE_FILE, or NULL.
+ * @param signalNumber Value of HMM_PROFILE_SIGNAL, a signal number such as "12" for SIGUSR2 on Linux, or NULL.
+ */
+void profile_start_from_env(uint64_t sampleRate, const char *prefix, const char *signalNumber)
+{
+    struct sigaction action;
+    char *end = NULL;
+    long number = 0;
+
+    if (prefix != NULL && prefix[0] != '\0' && strlen(prefix) < PROFILE_PREFIX_MAX)
+    {
+        strcpy(profileFilePrefix, prefix);
+    }
+
+    if (signalNumber != NULL)
+    {
+        number = strtol(signalNumber, &end, 10);
+        if (end != signalNumber && *end == '\0' && number > 0 && number < NSIG)
+        {
+            memset(&action, 0, sizeof(action));
+            action.sa_handler = profile_signal_handler;
+            action.sa_flags = SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            sigaction((int)number, &action, NULL);
+        }
+    }
+
+    HmmProfileStart(sampleRate);
+    profileDumpAtExit = 1;
+}
+
+/**
+ * @brief Writes the profile of a program profiled through HMM_PROFILE when it exits.
+ */
+__attribute__((destructor)) static void profile_dump_at_exit(void)
+{
+    if (profileDumpAtExit)
+    {
+        profile_dump_file();
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef PROFILER
+#define PROFILER
+
+#define PROFILE_MAX_DEPTH 32      /* Maximum number of frames captured per backtrace */
+#define PROFILE_MAX_STACKS 4096   /* Number of distinct call stacks that can be tracked */
+#define PROFILE_MAX_SAMPLES 65536 /* Number of live sampled allocations that can be tracked (power of two) */
+#define PROFILE_PREFIX_MAX 1024   /* Longest HMM_PROFILE_FILE prefix, including the terminating zero */
+
+#define HMM_PROFILE_PPROF 0     /* Legacy pprof heap profile (heap_v2) with MAPPED_LIBRARIES section */
+#define HMM_PROFILE_COLLAPSED 1 /* One "frame;frame;... bytes" line per stack, for flame graphs */
+
+// Define the ProfileStack structure: one captured call stack and the sampled bytes attributed to it
+typedef struct ProfileStack {
+    uint64_t hash;
+    uint32_t depth;
+    void *frames[PROFILE_MAX_DEPTH];
+    uint64_t liveBytes;
+    uint64_t liveCount;
+    uint64_t totalBytes;
+    uint64_t totalCount;
+} ProfileStack;
+
+// Define the ProfileSample structure: a live sampled allocation and the weight it carries
+typedef struct ProfileSample {
+    void *ptr;
+    uint32_t stackIndex;
+    uint64_t weight;
+    uint64_t count;
+} ProfileSample;
+
+// Sampling interval in bytes, 0 when profiling is off. Checked by the malloc/calloc/realloc wrappers.
+extern uint64_t profileSampleRate;
+
+// Function declarations
+void HmmProfileStart(uint64_t sampleRate);
+void HmmProfileStop(void);
+int HmmProfileDump(int fd, uint8_t format);
+int profile_dump_file(void);
+void profile_start_from_env(uint64_t sampleRate, const char *prefix, const char *signalNumber);
+void profile_record_alloc(void *ptr, uint64_t size);
+void profile_record_free(void *ptr);
+#endif
@@ -0,0 +1,527 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include "heap.h"
+#include "FreeList.h"
+#include "Stats.h"
+#include "Tune.h"
+#include "Pressure.h"
+#include "Reclaim.h"
+
+#define RECLAIM_QUEUE_MASK (RECLAIM_QUEUE_DEPTH - 1)
+
+extern char *programBreak;
+extern char *heapStart;
+
+// Non-zero while the reclaim thread runs, and the block length from which frees are handed to it
+uint8_t reclaimActive = 0;
+uint64_t reclaimThreshold = RECLAIM_DEFAULT_THRESHOLD;
+
+// Serialises the allocator and the reclaim thread. Recursive, since HmmRealloc and HmmCalloc call HmmAlloc/HmmFree.
+pthread_mutex_t heapLock;
+uint8_t heapLockReady = 0;
+
+// Single-producer single-consumer ring of freed blocks: HmmFree appends at the tail, the reclaim thread takes
+// from the head and advances it, under the heap lock, in the same step that puts the block in the free list
+void *reclaimQueue[RECLAIM_QUEUE_DEPTH];
+uint32_t reclaimHead = 0;
+uint32_t reclaimTail = 0;
+
+// Reclaim thread, its wake-up semaphore, and the requests it serves besides the queue
+pthread_t reclaimThread;
+sem_t reclaimWakeup;
+uint8_t reclaimWakePending = 0;
+uint8_t reclaimTrimPending = 0;
+uint8_t reclaimReleasePending = 0;
+uint8_t reclaimStopping = 0;
+
+// Set by the fork handlers when the heap lock was taken for fork
+uint8_t reclaimForkLocked = 0;
+
+/**
+ * @brief Takes the heap lock if the reclaim thread runs.
+ *
+ * @return uint8_t Whether the lock was taken, to be passed to heap_unlock.
+ */
+uint8_t heap_lock(void)
+{
+    if (!reclaimActive)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&heapLock);
+    return 1;
+}
+
+/**
+ * @brief Releases the heap lock taken by heap_lock.
+ *
+ * @param locked Value returned by the matching heap_lock.
+ */
+void heap_unlock(uint8_t locked)
+{
+    if (locked)
+    {
+        pthread_mutex_unlock(&heapLock);
+    }
+}
+
+/**
+ * @brief Puts the block at the head of the queue into the free list on behalf of HmmFree.
+ *
+ * While memory is under pressure the whole pages of the block are given back to the kernel first. The block is
+ * not in the free list yet, so this happens without holding the heap lock. The head of the queue moves past the
+ * block under the lock, so a fork never sees a block that is both in the free list and still queued.
+ *
+ * @param head Position of the block in the queue.
+ */
+static void reclaim_block(uint32_t head)
+{
+    void *blockPtr = reclaimQueue[head & RECLAIM_QUEUE_MASK];
+    FreeListNode *node = (FreeListNode *)(blockPtr - sizeof(FreeListNode));
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uintptr_t pagesStart = ((uintptr_t)blockPtr + sizeof(FreeBinLinks) + pageSize - 1) & ~(pageSize - 1);
+    uintptr_t pagesEnd = ((uintptr_t)blockPtr + node->length) & ~(pageSize - 1);
+    uint8_t released = 0;
+
+    if (memoryPressure && pagesEnd > pagesStart && madvise((void *)pagesStart, pagesEnd - pagesStart, MADV_DONTNEED) == 0)
+    {
+        released = 1;
+    }
+
+    pthread_mutex_lock(&heapLock);
+    mark_range_dirty(node, node->length + sizeof(FreeListNode));
+    if (tuneAdaptive)
+    {
+        tune_record_free(node->length);
+    }
+    insert_block_into_freelist(blockPtr);
+    if (released)
+    {
+        mark_range_zeroed((void *)pagesStart, pagesEnd - pagesStart);
+        HMM_STATS_COUNT(HMM_EVENT_PAGES_RELEASED);
+    }
+    __atomic_store_n(&reclaimHead, head + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&heapLock);
+}
+
+/**
+ * @brief Gives the whole free pages inside the process heap back to the kernel, like release_free_pages, but
+ * without holding the heap lock across the system calls.
+ *
+ * Sweeps the heap by address. A free block with whole pages is taken out of the free list, so it cannot be
+ * allocated, while its pages are released with the lock dropped. No block can be merged across a block that is
+ * out of the list, so the sweep carries on from the end of it. It is only put back once the next block has been
+ * taken out, or the sweep is over.
+ *
+ * @return uint64_t The number of bytes released.
+ */
+static uint64_t reclaim_release_pages(void)
+{
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t releasedBytes = 0;
+    FreeListNode *block = NULL;
+    FreeListNode *heldBlock = NULL;   // Block out of the free list that the sweep continues from
+    uintptr_t pagesStart = 0;
+    uintptr_t pagesEnd = 0;
+    int result = 0;
+
+    pthread_mutex_lock(&heapLock);
+    for (block = (FreeListNode *)heapStart; block != NULL && (char *)block < programBreak;
+         block = (FreeListNode *)((char *)block + sizeof(FreeListNode) + block->length))
+    {
+        if (!BLOCK_IS_FREE(block))
+        {
+            continue;
+        }
+
+        // Keep the node header and bin links, which live at the start of the block
+        pagesStart = ((uintptr_t)block + sizeof(FreeListNode) + sizeof(FreeBinLinks) + pageSize - 1) & ~(pageSize - 1);
+        pagesEnd = ((uintptr_t)block + sizeof(FreeListNode) + block->length) & ~(pageSize - 1);
+        if (pagesEnd <= pagesStart)
+        {
+            continue;
+        }
+
+        remove_freelist_node(block);
+        if (heldBlock != NULL)
+        {
+            insert_block_into_freelist((void *)heldBlock + sizeof(FreeListNode));
+        }
+        heldBlock = block;
+
+        pthread_mutex_unlock(&heapLock);
+        result = madvise((void *)pagesStart, pagesEnd - pagesStart, MADV_DONTNEED);
+        pthread_mutex_lock(&heapLock);
+
+        if (result == 0)
+        {
+            mark_range_zeroed((void *)pagesStart, pagesEnd - pagesStart);
+            releasedBytes += pagesEnd - pagesStart;
+            HMM_STATS_COUNT(HMM_EVENT_PAGES_RELEASED);
+        }
+    }
+    if (heldBlock != NULL)
+    {
+        insert_block_into_freelist((void *)heldBlock + sizeof(FreeListNode));
+    }
+    pthread_mutex_unlock(&heapLock);
+
+    return releasedBytes;
+}
+
+/**
+ * @brief Whether a pass has to run right away: a trim, a page release or the stop was asked for, or a batch of
+ * blocks is queued.
+ *
+ * @param head Head of the queue, as far as the reclaim thread got.
+ */
+static uint8_t reclaim_pass_requested(uint32_t head)
+{
+    return __atomic_load_n(&reclaimTrimPending, __ATOMIC_SEQ_CST) ||
+           __atomic_load_n(&reclaimReleasePending, __ATOMIC_SEQ_CST) ||
+           __atomic_load_n(&reclaimStopping, __ATOMIC_SEQ_CST) ||
+           __atomic_load_n(&reclaimTail, __ATOMIC_SEQ_CST) - head >= RECLAIM_WAKE_BATCH;
+}
+
+/**
+ * @brief Sleeps until the reclaim thread has work to do.
+ *
+ * With an empty queue and nothing requested, the thread blocks until reclaim_wake, so an idle process does not
+ * wake it at all. The first block put into an empty queue wakes it; it then waits up to RECLAIM_MAX_DELAY_MS
+ * for more blocks, or for another wake-up, so that a pass still handles a batch.
+ *
+ * @param head Head of the queue, as far as the reclaim thread got.
+ */
+static void reclaim_sleep(uint32_t head)
+{
+    struct timespec deadline;
+
+    if (__atomic_load_n(&reclaimTail, __ATOMIC_SEQ_CST) == head && !reclaim_pass_requested(head))
+    {
+        while (sem_wait(&reclaimWakeup) != 0 && errno == EINTR)
+        {
+        }
+        __atomic_store_n(&reclaimWakePending, 0, __ATOMIC_SEQ_CST);
+        if (reclaim_pass_requested(head))
+        {
+            return;
+        }
+    }
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += RECLAIM_MAX_DELAY_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (sem_timedwait(&reclaimWakeup, &deadline) != 0 && errno == EINTR)
+    {
+    }
+}
+
+/**
+ * @brief Body of the reclaim thread.
+ *
+ * Runs a pass when woken, or RECLAIM_MAX_DELAY_MS after a block was queued, and sleeps while there is nothing to
+ * do. A pass empties the queue, then trims the heap, or under memory pressure releases the free top of the heap.
+ * The free pages inside the heap are only released once per pressure episode, when reclaim_request_release asks
+ * for it.
+ *
+ * The thread runs as SCHED_BATCH, so waking it never preempts the thread that called HmmFree; it still gets its
+ * fair share of the CPU.
+ */
+static void *reclaim_thread_main(void *unused)
+{
+    struct sched_param schedParam = { 0 };
+    uint32_t head = 0;
+    uint8_t releasePending = 0;
+
+    (void)unused;
+    pthread_setschedparam(pthread_self(), SCHED_BATCH, &schedParam);
+    for (;;)
+    {
+        head = __atomic_load_n(&reclaimHead, __ATOMIC_RELAXED);
+        reclaim_sleep(head);
+        __atomic_store_n(&reclaimWakePending, 0, __ATOMIC_SEQ_CST);
+
+        releasePending = __atomic_exchange_n(&reclaimReleasePending, 0, __ATOMIC_RELAXED);
+        if (head == __atomic_load_n(&reclaimTail, __ATOMIC_ACQUIRE) && !releasePending &&
+            !__atomic_load_n(&reclaimTrimPending, __ATOMIC_RELAXED) &&
+            !__atomic_load_n(&reclaimStopping, __ATOMIC_ACQUIRE))
+        {
+            continue;
+        }
+
+        while (head != __atomic_load_n(&reclaimTail, __ATOMIC_ACQUIRE))
+        {
+            reclaim_block(head);
+            head++;
+        }
+
+        pthread_mutex_lock(&heapLock);
+        __atomic_store_n(&reclaimTrimPending, 0, __ATOMIC_RELAXED);
+        if (memoryPressure)
+        {
+            release_free_top();
+        }
+        else
+        {
+            trim_program_break();
+        }
+        pthread_mutex_unlock(&heapLock);
+
+        if (releasePending && memoryPressure)
+        {
+            reclaim_release_pages();
+        }
+
+        if (__atomic_load_n(&reclaimStopping, __ATOMIC_ACQUIRE) &&
+            head == __atomic_load_n(&reclaimTail, __ATOMIC_ACQUIRE))
+        {
+            return NULL;
+        }
+    }
+}
+
+/**
+ * @brief Hands a freed block to the reclaim thread.
+ *
+ * Called by HmmFree without the heap lock. The reclaim thread is woken by the first block put into an empty queue,
+ * which it then serves within RECLAIM_MAX_DELAY_MS, and again once RECLAIM_WAKE_BATCH blocks are queued, half the
+ * queue, so most frees do not pay for a wake-up. When the queue is full the caller is pushed back on and has to
+ * free the block itself, which keeps the memory waiting in the queue bounded.
+ *
+ * @param blockPtr Block being freed.
+ * @return int 1 if the block was queued, 0 if the queue is full.
+ */
+int reclaim_enqueue(void *blockPtr)
+{
+    uint32_t tail = reclaimTail;
+    uint32_t queued = 0;
+
+    if (tail - __atomic_load_n(&reclaimHead, __ATOMIC_ACQUIRE) == RECLAIM_QUEUE_DEPTH)
+    {
+        HMM_STATS_COUNT(HMM_EVENT_RECLAIM_BACKPRESSURE);
+        return 0;
+    }
+
+    // Sequentially consistent with the reclaim thread's check for an empty queue, so one of the two sees the block
+    reclaimQueue[tail & RECLAIM_QUEUE_MASK] = blockPtr;
+    __atomic_store_n(&reclaimTail, tail + 1, __ATOMIC_SEQ_CST);
+    queued = tail + 1 - __atomic_load_n(&reclaimHead, __ATOMIC_SEQ_CST);
+    if (queued == 1 || queued >= RECLAIM_WAKE_BATCH)
+    {
+        reclaim_wake();
+    }
+    HMM_STATS_COUNT(HMM_EVENT_RECLAIM_DEFERRED);
+
+    return 1;
+}
+
+/**
+ * @brief Asks the reclaim thread to trim the heap, if the top of the heap is worth trimming.
+ *
+ * Called by HmmFree with the heap lock held, in place of trim_program_break. Only wakes the thread when the last
+ * free block reaches the program break and is larger than a trim chunk, and not again until it has run.
+ */
+void reclaim_request_trim(void)
+{
+    FreeListNode *lastNode = freeBinIndex->tail;
+
+    if (lastNode == NULL || (char *)lastNode + sizeof(FreeListNode) + lastNode->length != programBreak)
+    {
+        return;
+    }
+    if (lastNode->length <= tuneConfig.trimSize && !memoryPressure)
+    {
+        return;
+    }
+
+    if (__atomic_exchange_n(&reclaimTrimPending, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        reclaim_wake();
+    }
+}
+
+/**
+ * @brief Asks the reclaim thread to release the free pages inside the heap, once memory pressure was detected.
+ *
+ * Called when pressure starts, not on every check while it lasts, since the release sweeps the whole heap.
+ */
+void reclaim_request_release(void)
+{
+    __atomic_store_n(&reclaimReleasePending, 1, __ATOMIC_SEQ_CST);
+    reclaim_wake();
+}
+
+/**
+ * @brief Wakes the reclaim thread, for example so it releases memory once pressure was detected.
+ *
+ * Only posts the semaphore once until the thread has started its next pass.
+ */
+void reclaim_wake(void)
+{
+    if (__atomic_exchange_n(&reclaimWakePending, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        sem_post(&reclaimWakeup);
+    }
+}
+
+/**
+ * @brief Sets up the heap lock, recursive since HmmRealloc and HmmCalloc call HmmAlloc and HmmFree.
+ */
+static void reclaim_init_lock(void)
+{
+    pthread_mutexattr_t attributes;
+
+    pthread_mutexattr_init(&attributes);
+    pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&heapLock, &attributes);
+    pthread_mutexattr_destroy(&attributes);
+}
+
+/**
+ * @brief Takes the heap lock before fork, so the child does not inherit a free list in the middle of an update.
+ */
+static void reclaim_fork_prepare(void)
+{
+    reclaimForkLocked = heap_lock();
+}
+
+static void reclaim_fork_parent(void)
+{
+    heap_unlock(reclaimForkLocked);
+}
+
+/**
+ * @brief Frees the queued blocks in the child after fork, where the reclaim thread does not exist, and turns
+ * deferred freeing off.
+ */
+static void reclaim_fork_child(void)
+{
+    uint32_t head = reclaimHead;
+
+    // The lock is still owned by the parent's thread, so it is set up again rather than unlocked
+    if (reclaimForkLocked)
+    {
+        reclaim_init_lock();
+    }
+    if (!reclaimActive)
+    {
+        return;
+    }
+
+    reclaimActive = 0;
+    while (head != reclaimTail)
+    {
+        HmmFree(reclaimQueue[head & RECLAIM_QUEUE_MASK]);
+        head++;
+    }
+    reclaimHead = head;
+    sem_destroy(&reclaimWakeup);
+}
+
+/**
+ * @brief Starts freeing large blocks, and trimming the heap, on a background thread.
+ *
+ * HmmFree then only queues blocks of at least `thresholdBytes` and returns; the reclaim thread puts them in the
+ * free list, trims the heap, and under memory pressure gives pages back to the kernel. While it runs, the
+ * allocator functions take a heap lock to stay consistent with it. Must be called, like HmmReclaimStop, from a
+ * thread that is not inside another HMM call.
+ *
+ * @param thresholdBytes Smallest block length that is freed in the background, 0 for 256 KB.
+ * @return int 0 on success, -1 if the thread cannot be started.
+ */
+int HmmReclaimStart(uint64_t thresholdBytes)
+{
+    if (reclaimActive)
+    {
+        return 0;
+    }
+
+    if (!heapLockReady)
+    {
+        reclaim_init_lock();
+        pthread_atfork(reclaim_fork_prepare, reclaim_fork_parent, reclaim_fork_child);
+        heapLockReady = 1;
+    }
+
+    if (sem_init(&reclaimWakeup, 0, 0) != 0)
+    {
+        return -1;
+    }
+    reclaimThreshold = (thresholdBytes != 0) ? thresholdBytes : RECLAIM_DEFAULT_THRESHOLD;
+    reclaimStopping = 0;
+    reclaimWakePending = 0;
+    reclaimTrimPending = 0;
+    reclaimReleasePending = 0;
+
+    if (pthread_create(&reclaimThread, NULL, reclaim_thread_main, NULL) != 0)
+    {
+        sem_destroy(&reclaimWakeup);
+        return -1;
+    }
+
+    reclaimActive = 1;
+    return 0;
+}
+
+/**
+ * @brief Waits until every queued block has been freed, then trims the heap.
+ */
+void HmmReclaimFlush(void)
+{
+    uint8_t locked = 0;
+
+    if (!reclaimActive)
+    {
+        return;
+    }
+
+    // Asking for a trim makes the thread run its pass now instead of waiting for more blocks
+    __atomic_store_n(&reclaimTrimPending, 1, __ATOMIC_SEQ_CST);
+    reclaim_wake();
+    while (__atomic_load_n(&reclaimHead, __ATOMIC_ACQUIRE) != reclaimTail)
+    {
+        sched_yield();
+    }
+
+    locked = heap_lock();
+    if (memoryPressure)
+    {
+        release_free_top();
+    }
+    else
+    {
+        trim_program_break();
+    }
+    heap_unlock(locked);
+}
+
+/**
+ * @brief Frees everything still queued, stops the reclaim thread and goes back to freeing inline.
+ */
+void HmmReclaimStop(void)
+{
+    if (!reclaimActive)
+    {
+        return;
+    }
+
+    __atomic_store_n(&reclaimStopping, 1, __ATOMIC_RELEASE);
+    sem_post(&reclaimWakeup);
+    pthread_join(reclaimThread, NULL);
+
+    reclaimActive = 0;
+    sem_destroy(&reclaimWakeup);
+}
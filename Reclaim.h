@@ -0,0 +1,25 @@
+#ifndef RECLAIM
+#define RECLAIM
+
+#define RECLAIM_QUEUE_DEPTH 256                /* Freed blocks that can wait for the reclaim thread (power of two) */
+#define RECLAIM_DEFAULT_THRESHOLD (256 * 1024) /* Smallest block handed to the reclaim thread by default */
+#define RECLAIM_WAKE_BATCH (RECLAIM_QUEUE_DEPTH / 2) /* Queued blocks that wake the reclaim thread early */
+#define RECLAIM_MAX_DELAY_MS 10                /* Longest a queued block waits for the reclaim thread */
+
+// Non-zero while the reclaim thread runs. The allocator then serialises with it through the heap lock.
+extern uint8_t reclaimActive;
+
+// Blocks at least this long are freed by the reclaim thread
+extern uint64_t reclaimThreshold;
+
+// Function declarations
+int HmmReclaimStart(uint64_t thresholdBytes);
+void HmmReclaimStop(void);
+void HmmReclaimFlush(void);
+uint8_t heap_lock(void);
+void heap_unlock(uint8_t locked);
+int reclaim_enqueue(void *blockPtr);
+void reclaim_request_trim(void);
+void reclaim_request_release(void);
+void reclaim_wake(void);
+#endif
@@ -0,0 +1,430 @@
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "SharedHeap.h"
+
+// Convert between offsets stored in the segment and addresses in this process
+#define SHARED_NODE(heap, offset) ((SharedFreeNode *)((char *)(heap) + (offset)))
+#define SHARED_OFFSET(heap, node) ((uint64_t)((char *)(node) - (char *)(heap)))
+
+/**
+ * @brief Rebuilds the free list from the blocks after a process died while holding the lock.
+ *
+ * Every update changes a block length or a free flag in a single store, after writing any header it exposes,
+ * so whatever a dying process left, the lengths still tile the segment. At worst two free blocks are adjacent,
+ * or a block was marked allocated but never handed out, and is lost. The free blocks are linked again in
+ * address order and adjacent ones merged.
+ *
+ * @param heap The locked heap.
+ * @return int 0 on success, -1 if the block lengths do not tile the segment, so the heap cannot be trusted.
+ */
+static int shared_heap_rebuild(HmmSharedHeap *heap)
+{
+    SharedFreeNode *node = NULL;
+    SharedFreeNode *previousNode = NULL;
+    uint64_t offset = SHARED_HEAP_HEADER_SIZE;
+    uint64_t nextOffset = 0;
+    uint64_t previousOffset = 0;
+
+    // Check the lengths first, so a damaged heap is left exactly as it was found
+    while (offset < heap->capacity)
+    {
+        node = SHARED_NODE(heap, offset);
+        if (heap->capacity - offset < sizeof(SharedFreeNode) || node->length < 8 || (node->length & 7) != 0 ||
+            node->length > heap->capacity - offset - sizeof(SharedFreeNode))
+        {
+            return -1;
+        }
+        offset += sizeof(SharedFreeNode) + node->length;
+    }
+
+    heap->freeListHead = 0;
+    for (offset = SHARED_HEAP_HEADER_SIZE; offset < heap->capacity; offset = nextOffset)
+    {
+        node = SHARED_NODE(heap, offset);
+        nextOffset = offset + sizeof(SharedFreeNode) + node->length;
+        if (node->prev == SHARED_BLOCK_IN_USE)
+        {
+            continue;
+        }
+
+        if (previousOffset != 0 && previousOffset + sizeof(SharedFreeNode) + previousNode->length == offset)
+        {
+            previousNode->length += sizeof(SharedFreeNode) + node->length;
+            continue;
+        }
+
+        node->prev = previousOffset;
+        node->next = 0;
+        if (previousOffset != 0)
+        {
+            previousNode->next = offset;
+        }
+        else
+        {
+            heap->freeListHead = offset;
+        }
+        previousOffset = offset;
+        previousNode = node;
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Locks the heap, taking over the lock if its previous owner died while holding it.
+ *
+ * A process that dies inside HmmSharedAlloc or HmmSharedFree can leave a half-updated free list, so the list is
+ * rebuilt from the blocks before the lock is marked consistent. If the blocks themselves are damaged, the lock
+ * is released without being made consistent, which makes it, and the heap, unusable for every process.
+ *
+ * @param heap Heap returned by HmmSharedOpen.
+ * @return int 0 if the lock is held, -1 with errno set (ENOTRECOVERABLE once the heap is unusable) otherwise.
+ */
+static int shared_heap_lock(HmmSharedHeap *heap)
+{
+    int result = pthread_mutex_lock(&heap->lock);
+
+    if (result == EOWNERDEAD)
+    {
+        if (shared_heap_rebuild(heap) != 0)
+        {
+            pthread_mutex_unlock(&heap->lock);
+            errno = ENOTRECOVERABLE;
+            return -1;
+        }
+        pthread_mutex_consistent(&heap->lock);
+        result = 0;
+    }
+    if (result != 0)
+    {
+        errno = result;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void shared_heap_unlock(HmmSharedHeap *heap)
+{
+    pthread_mutex_unlock(&heap->lock);
+}
+
+/**
+ * @brief Creates or opens a heap in a named POSIX shared memory segment.
+ *
+ * The creating process sizes the segment, sets up a process-shared robust mutex and one free block covering
+ * the whole segment. Every process may map the segment at a different address, since the free list only
+ * stores offsets. Pass blocks between processes with HmmSharedOffset and HmmSharedPointer.
+ *
+ * @param name Name of the segment, e.g. "/hmm-messages".
+ * @param capacity Size of the segment in bytes when creating it. Ignored when opening.
+ * @param create Non-zero to create a new segment (fails if it already exists), zero to open an existing one.
+ * @return HmmSharedHeap* The heap, or NULL on failure.
+ */
+HmmSharedHeap *HmmSharedOpen(const char *name, size_t capacity, int create)
+{
+    HmmSharedHeap *heap = MAP_FAILED;
+    pthread_mutexattr_t attributes;
+    struct stat segmentStat;
+    SharedFreeNode *firstNode = NULL;
+    int fd = -1;
+
+    fd = shm_open(name, O_RDWR | (create ? (O_CREAT | O_EXCL) : 0), 0600);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (create)
+    {
+        capacity = (capacity + SHARED_HEAP_HEADER_SIZE - 1) & ~((size_t)SHARED_HEAP_HEADER_SIZE - 1);
+        if (capacity <= SHARED_HEAP_HEADER_SIZE + sizeof(SharedFreeNode) || ftruncate(fd, capacity) != 0)
+        {
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+    }
+    else
+    {
+        if (fstat(fd, &segmentStat) != 0 || (size_t)segmentStat.st_size <= SHARED_HEAP_HEADER_SIZE)
+        {
+            close(fd);
+            return NULL;
+        }
+        capacity = segmentStat.st_size;
+    }
+
+    heap = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (heap == MAP_FAILED)
+    {
+        if (create)
+        {
+            shm_unlink(name);
+        }
+        return NULL;
+    }
+
+    if (create)
+    {
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attributes, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&heap->lock, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+
+        // One free block covers everything after the header
+        firstNode = SHARED_NODE(heap, SHARED_HEAP_HEADER_SIZE);
+        firstNode->length = capacity - SHARED_HEAP_HEADER_SIZE - sizeof(SharedFreeNode);
+        firstNode->prev = 0;
+        firstNode->next = 0;
+        heap->freeListHead = SHARED_HEAP_HEADER_SIZE;
+        heap->capacity = capacity;
+        __atomic_store_n(&heap->magic, SHARED_HEAP_MAGIC, __ATOMIC_RELEASE);
+    }
+    else if (__atomic_load_n(&heap->magic, __ATOMIC_ACQUIRE) != SHARED_HEAP_MAGIC || heap->capacity != capacity)
+    {
+        munmap(heap, capacity);
+        return NULL;
+    }
+
+    return heap;
+}
+
+/**
+ * @brief Unmaps a shared heap from this process. The segment and its blocks stay available to other processes.
+ *
+ * @param heap Heap returned by HmmSharedOpen.
+ */
+void HmmSharedClose(HmmSharedHeap *heap)
+{
+    if (heap != NULL)
+    {
+        munmap(heap, heap->capacity);
+    }
+}
+
+/**
+ * @brief Removes the name of a shared heap. The memory is released once every process has closed it.
+ *
+ * @param name Name passed to HmmSharedOpen.
+ * @return int 0 on success, -1 on failure.
+ */
+int HmmSharedUnlink(const char *name)
+{
+    return shm_unlink(name);
+}
+
+/**
+ * @brief Allocates a block in a shared heap.
+ *
+ * Takes the best fit from the address-ordered free list, and splits off the remainder when it can hold another
+ * node.
+ *
+ * @param heap Heap returned by HmmSharedOpen.
+ * @param size Size of the block in bytes.
+ * @return void* Pointer to the block in this process, or NULL if the segment has no block large enough or the
+ *               heap is unusable (errno is then ENOTRECOVERABLE).
+ */
+void *HmmSharedAlloc(HmmSharedHeap *heap, size_t size)
+{
+    SharedFreeNode *bestFitNode = NULL;
+    SharedFreeNode *currentNode = NULL;
+    uint64_t currentOffset = 0;
+
+    // No block is larger than the segment, which also keeps the rounding below from overflowing
+    if (size > heap->capacity)
+    {
+        return NULL;
+    }
+
+    // Same minimum size and word alignment as HmmAlloc
+    if (size < 24)
+    {
+        size = 24;
+    }
+    size = (size + 7) & ~(size_t)7;
+
+    if (shared_heap_lock(heap) != 0)
+    {
+        return NULL;
+    }
+
+    for (currentOffset = heap->freeListHead; currentOffset != 0; currentOffset = currentNode->next)
+    {
+        currentNode = SHARED_NODE(heap, currentOffset);
+        if (currentNode->length >= size && (bestFitNode == NULL || currentNode->length < bestFitNode->length))
+        {
+            bestFitNode = currentNode;
+        }
+    }
+
+    if (bestFitNode == NULL)
+    {
+        shared_heap_unlock(heap);
+        return NULL;
+    }
+
+    if (bestFitNode->length - size > sizeof(SharedFreeNode))
+    {
+        // Split: the remainder takes the best fit's place in the list, so address order is kept
+        SharedFreeNode *remainder = (SharedFreeNode *)((char *)bestFitNode + sizeof(SharedFreeNode) + size);
+        uint64_t remainderOffset = SHARED_OFFSET(heap, remainder);
+
+        remainder->length = bestFitNode->length - size - sizeof(SharedFreeNode);
+        remainder->prev = bestFitNode->prev;
+        remainder->next = bestFitNode->next;
+        if (remainder->prev != 0)
+        {
+            SHARED_NODE(heap, remainder->prev)->next = remainderOffset;
+        }
+        else
+        {
+            heap->freeListHead = remainderOffset;
+        }
+        if (remainder->next != 0)
+        {
+            SHARED_NODE(heap, remainder->next)->prev = remainderOffset;
+        }
+
+        // The remainder's header is complete before the shorter length exposes it as a block
+        __atomic_store_n(&bestFitNode->length, size, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        // Too little left to split, hand out the whole block
+        if (bestFitNode->prev != 0)
+        {
+            SHARED_NODE(heap, bestFitNode->prev)->next = bestFitNode->next;
+        }
+        else
+        {
+            heap->freeListHead = bestFitNode->next;
+        }
+        if (bestFitNode->next != 0)
+        {
+            SHARED_NODE(heap, bestFitNode->next)->prev = bestFitNode->prev;
+        }
+    }
+    __atomic_store_n(&bestFitNode->prev, SHARED_BLOCK_IN_USE, __ATOMIC_RELEASE);
+
+    shared_heap_unlock(heap);
+    return (char *)bestFitNode + sizeof(SharedFreeNode);
+}
+
+/**
+ * @brief Frees a block of a shared heap. Any process that has the heap open may free any block.
+ *
+ * The block is inserted in address order and merged with free neighbours on both sides.
+ *
+ * @param heap Heap returned by HmmSharedOpen.
+ * @param ptr Block returned by HmmSharedAlloc or HmmSharedPointer. NULL is ignored.
+ * @return int 0 on success, -1 if the heap is unusable (errno is then ENOTRECOVERABLE).
+ */
+int HmmSharedFree(HmmSharedHeap *heap, void *ptr)
+{
+    SharedFreeNode *node = NULL;
+    SharedFreeNode *previousNode = NULL;
+    SharedFreeNode *nextNode = NULL;
+    uint64_t nodeOffset = 0;
+    uint64_t previousOffset = 0;
+    uint64_t nextOffset = 0;
+
+    if (ptr == NULL)
+    {
+        return 0;
+    }
+
+    node = (SharedFreeNode *)((char *)ptr - sizeof(SharedFreeNode));
+    nodeOffset = SHARED_OFFSET(heap, node);
+
+    if (shared_heap_lock(heap) != 0)
+    {
+        return -1;
+    }
+
+    // Find the free nodes just below and just above the block
+    nextOffset = heap->freeListHead;
+    while (nextOffset != 0 && nextOffset < nodeOffset)
+    {
+        previousOffset = nextOffset;
+        nextOffset = SHARED_NODE(heap, nextOffset)->next;
+    }
+
+    node->prev = previousOffset;
+    node->next = nextOffset;
+
+    // Merge with the following free block if they touch
+    if (nextOffset != 0 && nodeOffset + sizeof(SharedFreeNode) + node->length == nextOffset)
+    {
+        nextNode = SHARED_NODE(heap, nextOffset);
+        node->length += sizeof(SharedFreeNode) + nextNode->length;
+        node->next = nextNode->next;
+    }
+    if (node->next != 0)
+    {
+        SHARED_NODE(heap, node->next)->prev = nodeOffset;
+    }
+
+    // Merge into the preceding free block if they touch, otherwise link after it
+    if (previousOffset != 0)
+    {
+        previousNode = SHARED_NODE(heap, previousOffset);
+        if (previousOffset + sizeof(SharedFreeNode) + previousNode->length == nodeOffset)
+        {
+            previousNode->length += sizeof(SharedFreeNode) + node->length;
+            previousNode->next = node->next;
+            if (node->next != 0)
+            {
+                SHARED_NODE(heap, node->next)->prev = previousOffset;
+            }
+        }
+        else
+        {
+            previousNode->next = nodeOffset;
+        }
+    }
+    else
+    {
+        heap->freeListHead = nodeOffset;
+    }
+
+    shared_heap_unlock(heap);
+    return 0;
+}
+
+/**
+ * @brief Converts a block pointer into an offset that is valid in every process using the heap.
+ *
+ * @param heap Heap returned by HmmSharedOpen.
+ * @param ptr Pointer into the heap.
+ * @return uint64_t Offset of `ptr` from the start of the segment, 0 for NULL.
+ */
+uint64_t HmmSharedOffset(HmmSharedHeap *heap, void *ptr)
+{
+    return (ptr == NULL) ? 0 : (uint64_t)((char *)ptr - (char *)heap);
+}
+
+/**
+ * @brief Converts an offset received from another process into a pointer in this process.
+ *
+ * @param heap Heap returned by HmmSharedOpen.
+ * @param offset Offset returned by HmmSharedOffset.
+ * @return void* Pointer into the heap, or NULL if the offset is 0 or outside the segment.
+ */
+void *HmmSharedPointer(HmmSharedHeap *heap, uint64_t offset)
+{
+    if (offset < SHARED_HEAP_HEADER_SIZE || offset >= heap->capacity)
+    {
+        return NULL;
+    }
+
+    return (char *)heap + offset;
+}
@@ -0,0 +1,33 @@
+#ifndef SHARED_HEAP
+#define SHARED_HEAP
+#include <pthread.h>
+
+#define SHARED_HEAP_MAGIC 0x44524853504d4d48ULL /* "HMMPSHRD" */
+#define SHARED_HEAP_HEADER_SIZE 4096            /* Blocks start one page into the segment */
+#define SHARED_BLOCK_IN_USE UINT64_MAX          /* prev of an allocated block */
+
+// Define the SharedFreeNode structure: like FreeListNode, but links are offsets from the segment start. Blocks
+// tile the segment from the header to its end.
+typedef struct SharedFreeNode {
+    uint64_t length;
+    uint64_t prev; // Offset of the previous free node, 0 if none, SHARED_BLOCK_IN_USE if the block is allocated
+    uint64_t next; // Offset of the next free node, 0 if none
+} SharedFreeNode;
+
+// Define the HmmSharedHeap structure: header at the start of the shared memory segment
+typedef struct HmmSharedHeap {
+    uint64_t magic;            // Written last when the segment is created, so openers never see a half-built heap
+    uint64_t capacity;         // Size of the segment in bytes
+    uint64_t freeListHead;     // Offset of the first free node, 0 if the segment is full
+    pthread_mutex_t lock;      // Process-shared, robust mutex protecting the free list
+} HmmSharedHeap;
+
+// Function declarations
+HmmSharedHeap *HmmSharedOpen(const char *name, size_t capacity, int create);
+void HmmSharedClose(HmmSharedHeap *heap);
+int HmmSharedUnlink(const char *name);
+void *HmmSharedAlloc(HmmSharedHeap *heap, size_t size);
+int HmmSharedFree(HmmSharedHeap *heap, void *ptr);
+uint64_t HmmSharedOffset(HmmSharedHeap *heap, void *ptr);
+void *HmmSharedPointer(HmmSharedHeap *heap, uint64_t offset);
+#endif
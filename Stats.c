@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "Stats.h"
+
+// Latency histograms, indexed by HMM_OP_*
+HmmLatencyHistogram hmmLatencyHistograms[HMM_OP_COUNT];
+
+// Slow-path event counters, indexed by HMM_EVENT_*
+uint64_t hmmEventCounters[HMM_EVENT_COUNT];
+
+const char *hmmOpNames[HMM_OP_COUNT] = { "HmmAlloc", "HmmFree", "HmmRealloc" };
+const char *hmmEventNames[HMM_EVENT_COUNT] = {
+    "break_increase", "break_decrease", "coalesce", "freelist_miss", "realloc_copy", "realloc_in_place",
+    "pages_released", "reclaim_deferred", "reclaim_backpressure"
+};
+
+/**
+ * @brief Reads a cheap timestamp: the TSC on x86, nanoseconds from CLOCK_MONOTONIC elsewhere.
+ */
+uint64_t stats_read_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+/**
+ * @brief Adds one measured operation to its log2 histogram.
+ *
+ * @param op HMM_OP_* identifier of the operation.
+ * @param cycles Duration of the operation in cycles.
+ */
+void stats_record_latency(uint8_t op, uint64_t cycles)
+{
+    HmmLatencyHistogram *histogram = &hmmLatencyHistograms[op];
+    uint32_t bucket = 63 - __builtin_clzll(cycles | 1);
+
+    histogram->count++;
+    histogram->totalCycles += cycles;
+    histogram->buckets[bucket]++;
+    if (cycles > histogram->maxCycles)
+    {
+        histogram->maxCycles = cycles;
+    }
+}
+
+/**
+ * @brief Copies the latency histogram of an operation.
+ *
+ * @param op HMM_OP_* identifier of the operation.
+ * @param histogram Destination of the copy.
+ * @return int 0 on success, -1 if `op` is out of range. All counts are zero unless built with HMM_STATS.
+ */
+int HmmStatsGetHistogram(uint8_t op, HmmLatencyHistogram *histogram)
+{
+    if (op >= HMM_OP_COUNT || histogram == NULL)
+    {
+        return -1;
+    }
+
+    *histogram = hmmLatencyHistograms[op];
+    return 0;
+}
+
+/**
+ * @brief Returns how many times a slow-path event happened.
+ *
+ * @param event HMM_EVENT_* identifier of the event.
+ * @return uint64_t The event count, or 0 if `event` is out of range.
+ */
+uint64_t HmmStatsGetCounter(uint8_t event)
+{
+    if (event >= HMM_EVENT_COUNT)
+    {
+        return 0;
+    }
+
+    return hmmEventCounters[event];
+}
+
+/**
+ * @brief Estimates a latency percentile of an operation from its histogram.
+ *
+ * The result is the upper bound of the bucket holding the percentile, so it is accurate to a factor of two.
+ *
+ * @param op HMM_OP_* identifier of the operation.
+ * @param percentile Percentile between 0 and 100, for example 99.9.
+ * @return uint64_t Cycle count at the percentile, or 0 if nothing was recorded.
+ */
+uint64_t HmmStatsPercentile(uint8_t op, double percentile)
+{
+    HmmLatencyHistogram *histogram = NULL;
+    double rank = 0;
+    uint64_t target = 0;
+    uint64_t seen = 0;
+    uint32_t i = 0;
+
+    if (op >= HMM_OP_COUNT || hmmLatencyHistograms[op].count == 0)
+    {
+        return 0;
+    }
+
+    histogram = &hmmLatencyHistograms[op];
+    rank = (double)histogram->count * percentile / 100.0;
+
+    // Nearest rank: round up, so that a tail percentile of a small sample still reaches the slowest operations
+    target = (uint64_t)rank;
+    if (target < rank || target == 0)
+    {
+        target++;
+    }
+
+    for (i = 0; i < HMM_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen >= target)
+        {
+            break;
+        }
+    }
+
+    return (i >= 63) ? histogram->maxCycles : (2ULL << i);
+}
+
+/**
+ * @brief Clears all histograms and event counters.
+ */
+void HmmStatsReset(void)
+{
+    memset(hmmLatencyHistograms, 0, sizeof(hmmLatencyHistograms));
+    memset(hmmEventCounters, 0, sizeof(hmmEventCounters));
+}
+
+/**
+ * @brief Writes a summary of latencies and slow-path events to a file descriptor.
+ *
+ * Formats into a stack buffer and writes it with write(), so it does not allocate.
+ *
+ * @param fd File descriptor to write to.
+ */
+void HmmStatsDump(int fd)
+{
+    char line[256];
+    int length = 0;
+    uint32_t i = 0;
+
+    for (i = 0; i < HMM_OP_COUNT; i++)
+    {
+        HmmLatencyHistogram *histogram = &hmmLatencyHistograms[i];
+
+        length = snprintf(line, sizeof(line),
+                          "hmm: %-10s count=%llu mean=%llu p50<=%llu p99<=%llu p999<=%llu max=%llu cycles\n",
+                          hmmOpNames[i],
+                          (unsigned long long)histogram->count,
+                          (unsigned long long)(histogram->count ? histogram->totalCycles / histogram->count : 0),
+                          (unsigned long long)HmmStatsPercentile(i, 50.0),
+                          (unsigned long long)HmmStatsPercentile(i, 99.0),
+                          (unsigned long long)HmmStatsPercentile(i, 99.9),
+                          (unsigned long long)histogram->maxCycles);
+        if (write(fd, line, length) != length)
+        {
+            return;
+        }
+    }
+
+    for (i = 0; i < HMM_EVENT_COUNT; i++)
+    {
+        length = snprintf(line, sizeof(line), "hmm: %-16s %llu\n", hmmEventNames[i],
+                          (unsigned long long)hmmEventCounters[i]);
+        if (write(fd, line, length) != length)
+        {
+            return;
+        }
+    }
+}
+
+#ifdef HMM_STATS
+/**
+ * @brief Dumps the statistics to stderr when the process exits.
+ */
+__attribute__((destructor)) static void stats_dump_at_exit(void)
+{
+    HmmStatsDump(STDERR_FILENO);
+}
+#endif
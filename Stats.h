@@ -0,0 +1,68 @@
+#ifndef STATS
+#define STATS
+
+#define HMM_HISTOGRAM_BUCKETS 64 /* Bucket i holds operations that took [2^i, 2^(i+1)) cycles */
+
+// Operations whose latency is measured
+#define HMM_OP_ALLOC 0
+#define HMM_OP_FREE 1
+#define HMM_OP_REALLOC 2
+#define HMM_OP_COUNT 3
+
+// Slow-path events that are counted
+#define HMM_EVENT_BREAK_INCREASE 0  /* increase_program_break grew the heap */
+#define HMM_EVENT_BREAK_DECREASE 1  /* decrease_program_break trimmed the heap */
+#define HMM_EVENT_COALESCE 2        /* insert_block_into_freelist merged adjacent free blocks */
+#define HMM_EVENT_FREELIST_MISS 3   /* find_best_fit_block found no suitable block */
+#define HMM_EVENT_REALLOC_COPY 4    /* HmmRealloc fell back to allocate-copy-free */
+#define HMM_EVENT_REALLOC_IN_PLACE 5 /* HmmRealloc grew or shrank the block in place */
+#define HMM_EVENT_PAGES_RELEASED 6 /* Free interior pages were returned to the kernel with madvise */
+#define HMM_EVENT_RECLAIM_DEFERRED 7 /* HmmFree queued a large block for the reclaim thread */
+#define HMM_EVENT_RECLAIM_BACKPRESSURE 8 /* The reclaim queue was full and HmmFree freed the block itself */
+#define HMM_EVENT_COUNT 9
+
+// Define the HmmLatencyHistogram structure: log-scale cycle histogram for one operation
+typedef struct HmmLatencyHistogram {
+    uint64_t count;
+    uint64_t totalCycles;
+    uint64_t maxCycles;
+    uint64_t buckets[HMM_HISTOGRAM_BUCKETS];
+} HmmLatencyHistogram;
+
+/*
+ * Instrumentation is compiled in with -DHMM_STATS and USDT probes with -DHMM_USDT (needs <sys/sdt.h>).
+ * Without those flags the macros below expand to nothing, so the hot path carries no extra code.
+ */
+#ifdef HMM_STATS
+#define HMM_STATS_TIMER_START(timer) uint64_t timer = stats_read_cycles()
+#define HMM_STATS_TIMER_STOP(op, timer) stats_record_latency((op), stats_read_cycles() - (timer))
+#define HMM_STATS_COUNT(event) (hmmEventCounters[(event)]++)
+#else
+#define HMM_STATS_TIMER_START(timer)
+#define HMM_STATS_TIMER_STOP(op, timer)
+#define HMM_STATS_COUNT(event)
+#endif
+
+#ifdef HMM_USDT
+#include <sys/sdt.h>
+#define HMM_PROBE1(name, a) STAP_PROBE1(hmm, name, a)
+#define HMM_PROBE2(name, a, b) STAP_PROBE2(hmm, name, a, b)
+#define HMM_PROBE3(name, a, b, c) STAP_PROBE3(hmm, name, a, b, c)
+#else
+#define HMM_PROBE1(name, a)
+#define HMM_PROBE2(name, a, b)
+#define HMM_PROBE3(name, a, b, c)
+#endif
+
+// Slow-path event counters, indexed by HMM_EVENT_*
+extern uint64_t hmmEventCounters[HMM_EVENT_COUNT];
+
+// Function declarations
+uint64_t stats_read_cycles(void);
+void stats_record_latency(uint8_t op, uint64_t cycles);
+int HmmStatsGetHistogram(uint8_t op, HmmLatencyHistogram *histogram);
+uint64_t HmmStatsGetCounter(uint8_t event);
+uint64_t HmmStatsPercentile(uint8_t op, double percentile);
+void HmmStatsReset(void);
+void HmmStatsDump(int fd);
+#endif
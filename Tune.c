@@ -0,0 +1,316 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "FreeList.h"
+#include "Tune.h"
+
+// Configuration in use, and the one adaptation started from
+HmmTuneConfig tuneConfig = { 24, 8, 200 * 1024, 128 * 1024 };
+HmmTuneConfig tuneBaseConfig = { 24, 8, 200 * 1024, 128 * 1024 };
+
+// Non-zero while the configuration adapts to the workload
+uint8_t tuneAdaptive = 0;
+
+// Blocks allocated and freed per size class, over the whole run
+TuneClass tuneClasses[FREE_BIN_COUNT];
+uint64_t tuneTotalAllocs = 0;
+
+// Counts for the current epoch
+uint32_t allocsUntilAdapt = TUNE_EPOCH_ALLOCS;
+uint32_t tuneEpochTinyAllocs = 0;
+uint32_t tuneEpochGrowths = 0;
+uint32_t tuneEpochTrims = 0;
+
+/**
+ * @brief Returns the smallest block length of a size class, the inverse of free_bin_index_of.
+ */
+static uint64_t class_lower_bound(uint32_t bin)
+{
+    uint32_t log2 = 0;
+
+    if (bin < 16)
+    {
+        return (uint64_t)bin << 3;
+    }
+
+    log2 = 7 + (bin - 16) / 4;
+    return (1ULL << log2) + (uint64_t)((bin - 16) % 4) * (1ULL << (log2 - 2));
+}
+
+/**
+ * @brief Checks that a configuration keeps blocks large and aligned enough for the free list.
+ *
+ * Block sizes must keep headers 8-byte aligned, and the growth step and trim chunk must be whole pages so the
+ * program break only ever moves by whole pages. Values that break these rules are rejected, not rounded.
+ */
+static int valid_config(const HmmTuneConfig *config)
+{
+    uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+
+    if (config->minBlockSize < FREE_NODE_MIN_LENGTH || (config->minBlockSize & 7) != 0)
+    {
+        return 0;
+    }
+    if (config->roundingSize < 8 || config->roundingSize > 4096 ||
+        (config->roundingSize & (config->roundingSize - 1)) != 0)
+    {
+        return 0;
+    }
+    if (config->growthSize < TUNE_MIN_STEP || config->trimSize < TUNE_MIN_STEP)
+    {
+        return 0;
+    }
+    if (config->growthSize % pageSize != 0 || config->trimSize % pageSize != 0)
+    {
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Adjusts the configuration to what the last epoch looked like.
+ *
+ * Runs from HmmAlloc between two allocations, where no block is half-way through a free list update. Each
+ * step moves a parameter by at most a factor of two, and never below the configuration adaptation started from:
+ *  - a heap that grew more than TUNE_GROWTHS_PER_EPOCH times grows in twice the step, one that did not grow
+ *    goes back towards the base step;
+ *  - a heap that was trimmed and grew again in the same epoch keeps twice as much free memory at the top, one
+ *    that was only trimmed goes back towards the base chunk;
+ *  - when at least a quarter of the requests are tiny, they are no longer padded to the base minimum.
+ */
+static void tune_adapt(void)
+{
+    if (tuneEpochGrowths > TUNE_GROWTHS_PER_EPOCH && tuneConfig.growthSize < TUNE_MAX_STEP)
+    {
+        tuneConfig.growthSize *= 2;
+    }
+    else if (tuneEpochGrowths == 0 && tuneConfig.growthSize / 2 >= tuneBaseConfig.growthSize)
+    {
+        tuneConfig.growthSize /= 2;
+    }
+
+    if (tuneEpochTrims > 0 && tuneEpochGrowths > 0 && tuneConfig.trimSize < TUNE_MAX_STEP)
+    {
+        tuneConfig.trimSize *= 2;
+    }
+    else if (tuneEpochTrims > 0 && tuneEpochGrowths == 0 && tuneConfig.trimSize / 2 >= tuneBaseConfig.trimSize)
+    {
+        tuneConfig.trimSize /= 2;
+    }
+
+    if ((uint64_t)tuneEpochTinyAllocs * 4 >= TUNE_EPOCH_ALLOCS)
+    {
+        tuneConfig.minBlockSize = FREE_NODE_MIN_LENGTH;
+    }
+    else
+    {
+        tuneConfig.minBlockSize = tuneBaseConfig.minBlockSize;
+    }
+
+    tuneEpochTinyAllocs = 0;
+    tuneEpochGrowths = 0;
+    tuneEpochTrims = 0;
+}
+
+/**
+ * @brief Starts adapting the configuration to the workload, beginning from the current one.
+ *
+ * The current configuration becomes the floor: adaptation only ever grows the steps from there, and the
+ * minimum block size returns to it whenever tiny requests become rare.
+ */
+void HmmTuneStart(void)
+{
+    tuneBaseConfig = tuneConfig;
+    memset(tuneClasses, 0, sizeof(tuneClasses));
+    tuneTotalAllocs = 0;
+    allocsUntilAdapt = TUNE_EPOCH_ALLOCS;
+    tuneEpochTinyAllocs = 0;
+    tuneEpochGrowths = 0;
+    tuneEpochTrims = 0;
+    tuneAdaptive = 1;
+}
+
+/**
+ * @brief Stops adapting and keeps the configuration reached so far.
+ */
+void HmmTuneStop(void)
+{
+    tuneAdaptive = 0;
+}
+
+/**
+ * @brief Copies the configuration in use.
+ *
+ * @param config Destination of the copy.
+ */
+void HmmTuneGet(HmmTuneConfig *config)
+{
+    *config = tuneConfig;
+}
+
+/**
+ * @brief Pins a configuration: it is used as is and adaptation stops.
+ *
+ * @param config Configuration to use.
+ * @return int 0 on success, -1 if the configuration is not valid (see HmmTuneConfig); nothing is rounded.
+ */
+int HmmTuneSet(const HmmTuneConfig *config)
+{
+    if (config == NULL || !valid_config(config))
+    {
+        return -1;
+    }
+
+    tuneAdaptive = 0;
+    tuneConfig = *config;
+    return 0;
+}
+
+/**
+ * @brief Writes the configuration in use as text that HmmTuneImport and HMM_TUNE accept.
+ *
+ * @param buffer Destination, TUNE_TEXT_MAX bytes is always enough.
+ * @param length Size of the buffer.
+ * @return int Length of the text, which was truncated if it is `length` or more.
+ */
+int HmmTuneExport(char *buffer, size_t length)
+{
+    return snprintf(buffer, length, "min=%llu,round=%llu,growth=%llu,trim=%llu",
+                    (unsigned long long)tuneConfig.minBlockSize,
+                    (unsigned long long)tuneConfig.roundingSize,
+                    (unsigned long long)tuneConfig.growthSize,
+                    (unsigned long long)tuneConfig.trimSize);
+}
+
+/**
+ * @brief Pins a configuration given as text, as written by HmmTuneExport.
+ *
+ * Parameters left out keep their current value.
+ *
+ * @param text Comma-separated key=value pairs with the keys min, round, growth and trim.
+ * @return int 0 on success, -1 if the text cannot be parsed or the configuration is not valid.
+ */
+int HmmTuneImport(const char *text)
+{
+    HmmTuneConfig config = tuneConfig;
+    const char *cursor = text;
+    char *end = NULL;
+    uint64_t *field = NULL;
+
+    while (*cursor != '\0')
+    {
+        if (strncmp(cursor, "min=", 4) == 0)
+        {
+            field = &config.minBlockSize;
+            cursor += 4;
+        }
+        else if (strncmp(cursor, "round=", 6) == 0)
+        {
+            field = &config.roundingSize;
+            cursor += 6;
+        }
+        else if (strncmp(cursor, "growth=", 7) == 0)
+        {
+            field = &config.growthSize;
+            cursor += 7;
+        }
+        else if (strncmp(cursor, "trim=", 5) == 0)
+        {
+            field = &config.trimSize;
+            cursor += 5;
+        }
+        else
+        {
+            return -1;
+        }
+
+        *field = strtoull(cursor, &end, 10);
+        if (end == cursor || (*end != ',' && *end != '\0'))
+        {
+            return -1;
+        }
+        cursor = (*end == ',') ? end + 1 : end;
+    }
+
+    return HmmTuneSet(&config);
+}
+
+/**
+ * @brief Writes the configuration and the per-class histogram to a file descriptor.
+ *
+ * For each size class it prints the blocks allocated, the blocks still live, and their mean lifetime in
+ * allocations, estimated as live blocks divided by the class's share of all allocations (Little's law).
+ * Formats into a stack buffer and writes it with write(), so it does not allocate.
+ *
+ * @param fd File descriptor to write to.
+ */
+void HmmTuneDump(int fd)
+{
+    char line[256];
+    int length = 0;
+    uint32_t i = 0;
+
+    length = snprintf(line, sizeof(line), "hmm: tune %s ", tuneAdaptive ? "adaptive" : "pinned");
+    length += HmmTuneExport(line + length, sizeof(line) - length);
+    line[length++] = '\n';
+    if (write(fd, line, length) != length)
+    {
+        return;
+    }
+
+    for (i = 0; i < FREE_BIN_COUNT; i++)
+    {
+        TuneClass *sizeClass = &tuneClasses[i];
+        uint64_t live = (sizeClass->allocs > sizeClass->frees) ? sizeClass->allocs - sizeClass->frees : 0;
+
+        if (sizeClass->allocs == 0)
+        {
+            continue;
+        }
+
+        length = snprintf(line, sizeof(line), "hmm: class>=%-10llu allocs=%llu live=%llu lifetime=%llu\n",
+                          (unsigned long long)class_lower_bound(i),
+                          (unsigned long long)sizeClass->allocs,
+                          (unsigned long long)live,
+                          (unsigned long long)(live * tuneTotalAllocs / sizeClass->allocs));
+        if (write(fd, line, length) != length)
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Counts an allocation and adapts the configuration at the end of each epoch.
+ *
+ * @param requestedSize Size the caller asked for.
+ * @param blockLength Length of the block handed out.
+ */
+void tune_record_alloc(uint64_t requestedSize, uint64_t blockLength)
+{
+    tuneClasses[free_bin_index_of(blockLength)].allocs++;
+    tuneTotalAllocs++;
+    if (requestedSize <= TUNE_TINY_SIZE)
+    {
+        tuneEpochTinyAllocs++;
+    }
+
+    if (--allocsUntilAdapt == 0)
+    {
+        allocsUntilAdapt = TUNE_EPOCH_ALLOCS;
+        tune_adapt();
+    }
+}
+
+/**
+ * @brief Counts a free.
+ *
+ * @param blockLength Length of the freed block.
+ */
+void tune_record_free(uint64_t blockLength)
+{
+    tuneClasses[free_bin_index_of(blockLength)].frees++;
+}
@@ -0,0 +1,45 @@
+#ifndef TUNE
+#define TUNE
+
+#define TUNE_EPOCH_ALLOCS 65536              /* Allocations between two adaptation steps */
+#define TUNE_GROWTHS_PER_EPOCH 4             /* More heap growths than this in an epoch doubles the growth step */
+#define TUNE_MIN_STEP (64 * 1024)            /* Smallest growth step or trim chunk that can be configured */
+#define TUNE_MAX_STEP (64 * 1024 * 1024)     /* Largest growth step or trim chunk the adaptation moves to */
+#define TUNE_TINY_SIZE 16                    /* Requests up to this size count as tiny */
+#define TUNE_TEXT_MAX 128                    /* Buffer size that always holds an exported configuration */
+
+// Define the HmmTuneConfig structure: the allocator's size and growth parameters
+typedef struct HmmTuneConfig {
+    uint64_t minBlockSize; // Smallest block handed out, a multiple of 8 and at least FREE_NODE_MIN_LENGTH
+    uint64_t roundingSize; // Requests are rounded up to a multiple of this power of two, at least 8
+    uint64_t growthSize;   // Step the heap grows by for requests that fit in it, a multiple of the page size
+    uint64_t trimSize;     // Free memory at the top of the heap is given back in chunks of this size, whole pages
+} HmmTuneConfig;
+
+// Define the TuneClass structure: requests counted for one size class (same classes as the free-list bins)
+typedef struct TuneClass {
+    uint64_t allocs;
+    uint64_t frees;
+} TuneClass;
+
+// Configuration in use
+extern HmmTuneConfig tuneConfig;
+
+// Non-zero while the configuration adapts to the workload. Checked by HmmAlloc and HmmFree.
+extern uint8_t tuneAdaptive;
+
+// Heap growths and trims of the process heap in the current epoch, counted by the program break functions
+extern uint32_t tuneEpochGrowths;
+extern uint32_t tuneEpochTrims;
+
+// Function declarations
+void HmmTuneStart(void);
+void HmmTuneStop(void);
+void HmmTuneGet(HmmTuneConfig *config);
+int HmmTuneSet(const HmmTuneConfig *config);
+int HmmTuneExport(char *buffer, size_t length);
+int HmmTuneImport(const char *text);
+void HmmTuneDump(int fd);
+void tune_record_alloc(uint64_t requestedSize, uint64_t blockLength);
+void tune_record_free(uint64_t blockLength);
+#endif
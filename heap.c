@@ -1,30 +1,60 @@
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include "heap.h"
 #include "FreeList.h"
+#include "Profiler.h"
+#include "Stats.h"
+#include "Pressure.h"
+#include "Tune.h"
+#include "Reclaim.h"
+
+extern FreeListNode *FreeListHead;
 
 #define SIZE (1024 * 1024 * 1024) /* 1 GB - Total memory size */
-#define PAGE_SIZE (200 * 1024)    /* 200 KB - Size of each memory page */
-#define FREE_SIZE (128 * 1024)    /* 128 KB - Size of the free block threshold */
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
 
 // Simulated program break for memory management
 char *programBreak;
 
-/* Size of a word in bytes */
-size_t word_size = 8; /* 8 bytes */
+// Region the program break functions operate on, NULL for the process heap managed with sbrk
+HeapRegion *activeRegion = NULL;
+
+// End of the memory reserved by HmmReserve; the process heap is never trimmed below it
+char *reservedBreak = NULL;
+
+// Start of the process heap, where its first block begins
+char *heapStart = NULL;
+
+// Highest program break the process heap has reached; bytes at or above it have never been handed out
+char *breakHighWater = NULL;
+
+// Where the next compaction step resumes, maintained by Handle.c
+extern FreeListNode *compactResume;
 
 /**
  * Custom implementation of malloc to allocate memory.
  * This function uses the HmmAlloc function to handle memory allocation.
+ * When heap profiling is on, the allocation is passed to the sampling profiler.
  *
  * @param size The size of memory to allocate in bytes.
  * @return A pointer to the allocated memory, or NULL if allocation fails.
  */
 void *malloc(size_t size)
 {
-    return HmmAlloc(size);
+    void *ptr = HmmAlloc(size);
+
+    if (profileSampleRate != 0)
+    {
+        profile_record_alloc(ptr, size);
+    }
+    return ptr;
 }
 
 /**
@@ -37,6 +67,10 @@ void free(void *ptr)
 {
     if (ptr != NULL)
     {
+        if (profileSampleRate != 0)
+        {
+            profile_record_free(ptr);
+        }
         HmmFree(ptr);
     }
 }
@@ -51,7 +85,13 @@ void free(void *ptr)
  */
 void *calloc(size_t nmemb, size_t size)
 {
-    return HmmCalloc(nmemb, size);
+    void *ptr = HmmCalloc(nmemb, size);
+
+    if (profileSampleRate != 0)
+    {
+        profile_record_alloc(ptr, nmemb * size);
+    }
+    return ptr;
 }
 
 /**
@@ -70,8 +110,68 @@ void *realloc(void *ptr, size_t size)
         return malloc(size);
     }
 
+    // A size of zero frees the block, and the profiler has to forget it
+    if (size == 0)
+    {
+        free(ptr);
+        return NULL;
+    }
+
     // Otherwise, resize the existing memory block
-    return HmmRealloc(ptr, size);
+    void *newPtr = HmmRealloc(ptr, size);
+
+    // Profile the resize as a free of the old block and an allocation of the new one
+    if (profileSampleRate != 0 && newPtr != NULL)
+    {
+        profile_record_free(ptr);
+        profile_record_alloc(newPtr, size);
+    }
+    return newPtr;
+}
+
+/**
+ * @brief Calculates how much to grow the program break for a request.
+ *
+ * Requests that fit in a single growth step grow the heap by tuneConfig.growthSize. Larger requests grow it in
+ * one step by enough whole steps to hold the block and its header, instead of one step per loop iteration.
+ *
+ * @param requestedSize The aligned size of the memory block being allocated.
+ * @return size_t The number of bytes to grow the program break by.
+ */
+size_t calculate_growth_size(size_t requestedSize)
+{
+    size_t step = tuneConfig.growthSize;
+    size_t growthSize = step;
+
+    if (requestedSize + sizeof(FreeListNode) > step)
+    {
+        growthSize = ((requestedSize + sizeof(FreeListNode) + step - 1) / step) * step;
+    }
+
+    return growthSize;
+}
+
+/**
+ * @brief Puts the memory the heap just grew by, from `blockStart` to the program break, into the free list.
+ *
+ * The free block that ended at the old break, if there is one, is recorded in the new block's header so the
+ * two are merged.
+ *
+ * @param blockStart The program break before the heap grew.
+ */
+static void insert_grown_block(char *blockStart)
+{
+    FreeListNode *node = (FreeListNode *)blockStart;
+    FreeListNode *lastNode = freeBinIndex->tail;
+
+    node->length = (uint64_t)(programBreak - blockStart) - sizeof(FreeListNode);
+    node->prev = BLOCK_IN_USE;
+    node->next = NULL;
+    if (lastNode != NULL && (char *)lastNode + sizeof(FreeListNode) + lastNode->length == blockStart)
+    {
+        node->next = lastNode;
+    }
+    insert_block_into_freelist(blockStart + sizeof(FreeListNode));
 }
 
 /**
@@ -79,98 +179,81 @@ void *realloc(void *ptr, size_t size)
  *
  * This function allocates a block of memory of at least the requested size. If the requested size is
  * smaller than the minimum block size, it is adjusted. The function also handles memory allocation
- * by adjusting the program break and searching for the best fit in the freelist.
+ * by adjusting the program break and searching for the best fit in the freelist. Requests larger than
+ * PTRDIFF_MAX fail before any size arithmetic is done on them.
  *
  * @param requestedSize The size of the memory block to allocate.
  * @return Pointer to the allocated memory block, or NULL if allocation fails.
  */
 void *HmmAlloc(size_t requestedSize)
 {
+    HMM_STATS_TIMER_START(startCycles);
+    size_t growthSize;                 // Number of bytes to grow the program break by
     void *allocatedAddress = NULL;     // Pointer to the allocated memory block
     char *previousProgramBreak = NULL; // Temporary pointer for program break management
-    char *initialProgramBreak;         // Pointer to track the initial program break position
-    static uint8_t initializationFlag = 0; // Flag to check if the program break has been initialized
-  
-    // Initialize the program break if it hasn't been initialized yet
-    if (initializationFlag == 0)
+    size_t callerSize = requestedSize; // Size as requested, before adjustment
+    uint8_t grewHeap = 0;              // Whether the program break was raised for this request
+    uint8_t locked = 0;                // Held while the reclaim thread runs
+
+    // Larger requests could never be satisfied, and rounding them or adding a header would wrap around
+    if (requestedSize > PTRDIFF_MAX)
     {
-        initialProgramBreak = increase_program_break(0);
-        programBreak = initialProgramBreak;
-        initializationFlag++;
+        return NULL;
     }
 
+    locked = heap_lock();
+
     // Adjust the requested size to the minimum block size if it's too small
-    if (requestedSize < 24)
+    if (requestedSize < tuneConfig.minBlockSize)
     {
-        requestedSize = 24;
+        requestedSize = tuneConfig.minBlockSize;
     }
 
-    // Align the requested size to the nearest multiple of the word size
-    requestedSize = (requestedSize + word_size - 1) & ~(word_size - 1);
+    // Round the requested size up to the configured granularity
+    requestedSize = (requestedSize + tuneConfig.roundingSize - 1) & ~(tuneConfig.roundingSize - 1);
+    growthSize = calculate_growth_size(requestedSize);
 
-    // Check if the program break is pointing to the initial position
-    if (programBreak == initialProgramBreak)
+    // Search for a suitable block in the freelist, growing the heap until one fits
+    allocatedAddress = find_best_fit_block(requestedSize);
+    while (allocatedAddress == NULL)
     {
-        previousProgramBreak = programBreak;
-        programBreak = (char *)increase_program_break(PAGE_SIZE);
-        
-        // Check if sbrk increment was successful
+        // Allocations made by other constructors before heap_init ran start the heap here
         if (programBreak == NULL)
         {
-            allocatedAddress = NULL;
-            programBreak = previousProgramBreak;
+            programBreak = (char *)sbrk(0);
+            heapStart = programBreak;
         }
-        else
+
+        // Allocate additional memory if no suitable block was found
+        previousProgramBreak = programBreak;
+        programBreak = (char *)increase_program_break(growthSize);
+
+        if (programBreak == NULL)
         {
-            *(uint64_t *)previousProgramBreak = (uint64_t)(programBreak - previousProgramBreak) - 24;
-            insert_block_into_freelist(previousProgramBreak + 24);
-            
-            // Find a suitable block in the freelist
-            allocatedAddress = find_best_fit_block(requestedSize);
- 	    while((allocatedAddress-24) == NULL)
-            {
-                // Allocate additional memory if no suitable block was found
-                previousProgramBreak = programBreak;
-                programBreak = (char *)increase_program_break(PAGE_SIZE);
-                
-                if (programBreak == NULL)
-                {
-                    allocatedAddress = NULL;
-                    programBreak = previousProgramBreak;
-                }
-                else
-                {
-                    *(uint64_t *)previousProgramBreak = (uint64_t)(programBreak - previousProgramBreak) - 24;
-                    insert_block_into_freelist(previousProgramBreak + 24);
-                    allocatedAddress = find_best_fit_block(requestedSize);
-                }
-            }
+            // The heap cannot grow any further
+            programBreak = previousProgramBreak;
+            break;
         }
+
+        insert_grown_block(previousProgramBreak);
+        allocatedAddress = find_best_fit_block(requestedSize);
+        grewHeap = 1;
     }
-    else
+
+    // A heap that keeps growing is a good moment to look at memory pressure, as frees may be rare
+    if (grewHeap && pressureSource != PRESSURE_SOURCE_NONE)
     {
-        // Search for a suitable block in the freelist
-        allocatedAddress = find_best_fit_block(requestedSize);
- 	while((allocatedAddress-24) == NULL)
-        {
-            // Allocate additional memory if no suitable block was found
-            previousProgramBreak = programBreak;
-            programBreak = (char *)increase_program_break(PAGE_SIZE);
-            
-            if (programBreak == NULL)
-            {
-                allocatedAddress = NULL;
-                programBreak = previousProgramBreak;
-            }
-            else
-            {
-                *(uint64_t *)previousProgramBreak = (uint64_t)(programBreak - previousProgramBreak) - 24;
-                insert_block_into_freelist(previousProgramBreak + 24);
-                allocatedAddress = find_best_fit_block(requestedSize);
-            }
-        }
+        pressure_poll_growth();
+    }
+
+    if (tuneAdaptive && allocatedAddress != NULL)
+    {
+        tune_record_alloc(callerSize, *(uint64_t *)(allocatedAddress - sizeof(FreeListNode)));
     }
 
+    heap_unlock(locked);
+    HMM_PROBE2(alloc, requestedSize, allocatedAddress);
+    HMM_STATS_TIMER_STOP(HMM_OP_ALLOC, startCycles);
     return allocatedAddress;
 }
 
@@ -180,39 +263,162 @@ void *HmmAlloc(size_t requestedSize)
  *
  * This function deallocates the memory block pointed to by `ptr`, adds it to the freelist, and tries to reduce
  * the program break if sufficient free memory is available. The program break is adjusted based on the amount
- * of contiguous free memory identified.
+ * of contiguous free memory identified. While the reclaim thread runs, large blocks are only queued for it, and
+ * trimming is left to it as well.
  *
  * @param ptr Pointer to the memory block to be freed.
  */
 void HmmFree(void *blockPtr)
 {
-    char *newProgramBreak = NULL;  // Temporary pointer for program break adjustment
-    uint32_t reductionCount = 0;      // Number of program break decrements
+    HMM_STATS_TIMER_START(startCycles);
+    uint8_t locked = 0;
+
+    /* Large blocks of the process heap go to the reclaim thread, unless its queue is full */
+    if (reclaimActive && activeRegion == NULL &&
+        *(uint64_t *)(blockPtr - sizeof(FreeListNode)) >= reclaimThreshold && reclaim_enqueue(blockPtr))
+    {
+        HMM_PROBE1(free, blockPtr);
+        HMM_STATS_TIMER_STOP(HMM_OP_FREE, startCycles);
+        return;
+    }
+
+    locked = heap_lock();
+    /* The caller may have written anywhere in the block, so it is no longer known to be zero */
+    mark_range_dirty(blockPtr - sizeof(FreeListNode), *(uint64_t *)(blockPtr - sizeof(FreeListNode)) + sizeof(FreeListNode));
+
+    if (tuneAdaptive)
+    {
+        tune_record_free(*(uint64_t *)(blockPtr - sizeof(FreeListNode)));
+    }
 
     /* Add the freed memory block to the freelist */
     insert_block_into_freelist(blockPtr);
 
-    /* Determine how many times the program break can be decreased based on free memory */
-    reductionCount = calculate_decreases_in_program_break();
+    /* Give free memory at the top of the heap back to the kernel, all of it while memory is under pressure */
+    if (reclaimActive && activeRegion == NULL)
+    {
+        reclaim_request_trim();
+    }
+    else if (memoryPressure && activeRegion == NULL)
+    {
+        release_free_top();
+    }
+    else
+    {
+        trim_program_break();
+    }
+
+    /* Periodically re-evaluate memory pressure if a pressure source is being watched */
+    if (pressureSource != PRESSURE_SOURCE_NONE)
+    {
+        pressure_poll();
+    }
+
+    heap_unlock(locked);
+    HMM_PROBE1(free, blockPtr);
+    HMM_STATS_TIMER_STOP(HMM_OP_FREE, startCycles);
+}
+
+/**
+ * @brief Lowers the program break into the free block at the top of the heap, which must end at the break.
+ *
+ * The part of the block below the new break stays in the free list. If the break cannot be lowered, the block
+ * is left as it was.
+ *
+ * @param newProgramBreak New end of the heap: the start of the block, or far enough into it to leave a free block.
+ * @return size_t The number of bytes released.
+ */
+static size_t lower_program_break_to(char *newProgramBreak)
+{
+    FreeListNode *lastNode = freeBinIndex->tail;
+    size_t releasedBytes = programBreak - newProgramBreak;
+    char *resultingBreak = NULL;
+
+    remove_freelist_node(lastNode);
+    resultingBreak = (char *)decrease_program_break(releasedBytes);
+    if (resultingBreak == NULL)
+    {
+        insert_block_into_freelist((void *)lastNode + sizeof(FreeListNode));
+        return 0;
+    }
+    programBreak = resultingBreak;
+
+    // Keep what is left below the new break
+    if (newProgramBreak > (char *)lastNode)
+    {
+        lastNode->length = newProgramBreak - (char *)lastNode - sizeof(FreeListNode);
+        insert_block_into_freelist((void *)lastNode + sizeof(FreeListNode));
+    }
+
+    return releasedBytes;
+}
 
-    /* If the program break can be decreased, perform the adjustment */
-    if (reductionCount > 0)
+/**
+ * @brief Lowers the program break if enough contiguous free memory sits at the top of the heap.
+ *
+ * The free blocks at the top are released in tuneConfig.trimSize chunks, and any remainder stays in the freelist.
+ * The process heap is never trimmed below the reserve made by HmmReserve.
+ */
+void trim_program_break(void)
+{
+    uint64_t decrease = 0;   // Number of bytes to lower the program break by
+
+    /* Determine how far the program break can be lowered based on free memory */
+    decrease = calculate_decreases_in_program_break();
+
+    /* If the program break can be lowered, perform the adjustment */
+    if (decrease > 0)
     {
-        newProgramBreak = (char *)decrease_program_break(reductionCount * FREE_SIZE);
+        lower_program_break_to(programBreak - decrease);
     }
+}
 
-    /* Update the program break if the decrement was successful */
-    if (newProgramBreak != NULL)
+/**
+ * @brief Releases the entire free block at the top of the heap.
+ *
+ * Unlike trim_program_break, which only gives back whole trim chunks and keeps the rest, this lowers the
+ * program break to the first page boundary in the free block at the top of the heap, but not below the reserve
+ * made by HmmReserve. It is used while memory is under pressure.
+ *
+ * @return size_t The number of bytes released.
+ */
+size_t release_free_top(void)
+{
+    FreeListNode *lastNode = freeBinIndex->tail;
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    char *newProgramBreak = NULL;
+
+    // Free blocks are coalesced, so the top of the heap is free only if one free block reaches the break
+    if (lastNode == NULL || (char *)lastNode + sizeof(FreeListNode) + lastNode->length != programBreak)
     {
-        programBreak = newProgramBreak;
+        return 0;
     }
+
+    // The reserved part of the heap stays mapped, so only the part of the block above it is released
+    newProgramBreak = ((char *)lastNode < reservedBreak) ? reservedBreak : (char *)lastNode;
+
+    // Stop at a page boundary, and leave either nothing or a whole free block below it
+    newProgramBreak = (char *)(((uintptr_t)newProgramBreak + pageSize - 1) & ~(pageSize - 1));
+    if (newProgramBreak > (char *)lastNode &&
+        (size_t)(newProgramBreak - (char *)lastNode) < sizeof(FreeListNode) + FREE_NODE_MIN_LENGTH)
+    {
+        newProgramBreak += pageSize;
+    }
+    if (newProgramBreak >= programBreak)
+    {
+        return 0;
+    }
+
+    return lower_program_break_to(newProgramBreak);
 }
 
 /**
  * @brief Allocates memory for an array of elements, initializing all bytes to zero.
  *
  * This function allocates a block of memory for an array of `nmemb` elements, each of size `size`, and initializes
- * the entire block to zero. If the allocation fails, it returns NULL.
+ * the entire block to zero. Only the parts of the block that are not already known to be zero (fresh pages from
+ * the program break) are cleared, so large allocations carved from new memory skip the memset entirely.
+ * If `nmemb * size` overflows or the allocation fails, it returns NULL.
  *
  * @param nmemb Number of elements to allocate.
  * @param size Size of each element.
@@ -221,188 +427,187 @@ void HmmFree(void *blockPtr)
 void *HmmCalloc(size_t nmemb, size_t size)
 {
     void *memory_block = NULL;
-    uint64_t total_size = nmemb * size;
+    uint64_t total_size = 0;
+    uint8_t locked = 0;
+
+    /* Reject requests whose total size does not fit in a size_t */
+    if (size != 0 && nmemb > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+    total_size = nmemb * size;
+
+    /* The known-zero ranges must not change between the allocation and the clearing */
+    locked = heap_lock();
 
     /* Allocate memory for the specified number of elements */
     memory_block = HmmAlloc(total_size);
 
-    /* If allocation succeeded, initialize the memory to zero */
+    /* If allocation succeeded, zero the bytes that are not already known to be zero */
     if (memory_block != NULL)
     {
-        memory_block = memset(memory_block, 0, total_size);
+        clear_dirty_bytes(memory_block, total_size);
     }
 
+    heap_unlock(locked);
     return memory_block;
 }
 
 /**
  * @brief Reallocates a memory block to a new size, either expanding or shrinking it.
  *
- * This function adjusts the size of a previously allocated memory block. If the requested size is
- * larger than the current size, it attempts to find a suitable block or extend the memory. If the
- * requested size is smaller, it reduces the size of the allocated block as needed.
+ * This function adjusts the size of a previously allocated memory block. The new size is rounded like an
+ * HmmAlloc request. A block that has to grow first takes in the free block that follows it, if that is large
+ * enough. Otherwise it is moved: a new block is allocated, the contents are copied and the old block is freed.
+ * A block that shrinks stays in place. Whatever a block no longer needs is freed if it can hold a free block of
+ * its own. A new size of 0 frees the block.
  *
  * @param originalPtr Pointer to the previously allocated memory block.
  * @param newSize The desired new size for the memory block.
- * @return Pointer to the reallocated memory block, or NULL if allocation fails.
+ * @return Pointer to the reallocated memory block, or NULL if the size is 0 or the allocation fails.
  */
 void *HmmRealloc(void *originalPtr, size_t newSize)
 {
-    char *previousProgramBreak = NULL; // Temporary pointer for program break management
+    HMM_STATS_TIMER_START(startCycles);
+    FreeListNode *node = (FreeListNode *)(originalPtr - sizeof(FreeListNode)); // Header of the current block
+    FreeListNode *nextNode = NULL;     // Header of the block that follows the current one
+    FreeListNode *tailNode = NULL;     // Header of the part cut off a resized block
     uint64_t currentBlockSize;         // Size of the current memory block
-    uint64_t freeSpaceSize;            // Size of the free space after resizing
     void *newBlockPtr = NULL;          // Pointer to the new memory block
+    uint8_t locked = 0;                // Held while the reclaim thread runs
+
+    // Like HmmAlloc, fail sizes that would wrap when rounded; the original block is left as it is
+    if (newSize > PTRDIFF_MAX)
+    {
+        return NULL;
+    }
 
-    // Handle case where the new size is zero (free the memory block)
+    locked = heap_lock();
+
+    // A new size of zero frees the memory block
     if (newSize == 0)
     {
-         newBlockPtr = malloc(24);
+        HmmFree(originalPtr);
     }
-    
     else
     {
-	    // Calculate the current block size
-            currentBlockSize = *(uint64_t *)(originalPtr - 24);
-
-	    // Handle case where the new size is larger than the current size
-            if (newSize > currentBlockSize)
-	    {
-	    	    // Try to find a suitable free block that can accommodate the new size
-                    newBlockPtr = find_best_fit_block(newSize - currentBlockSize);
-
-	    	    if ((newBlockPtr-24) == NULL)
-	    	    {
-			    // If no suitable block is found, allocate additional memory
-                            previousProgramBreak = programBreak;
-			    programBreak = (char *)increase_program_break(PAGE_SIZE);
-            
-			    // Check if sbrk increment was successful
-			    if (programBreak == NULL)
-			    {
-		    		    newBlockPtr = NULL;
-		    		    programBreak = previousProgramBreak;
-			    }
-			    else
-			    {
-		    		    *(uint64_t *)previousProgramBreak = (uint64_t)(programBreak - previousProgramBreak) - 24;
-		    		    insert_block_into_freelist(previousProgramBreak + 24);
-                
-		    		    // Try to find a suitable block again
-                                    newBlockPtr = find_best_fit_block(newSize);
-		    		    while ((newBlockPtr-24) == NULL)
-		    		    {
-					    previousProgramBreak = programBreak;
-					    programBreak = (char *)increase_program_break(PAGE_SIZE);
-                    
-					    if (programBreak == NULL)
-					    {
-			    			    newBlockPtr = NULL;
-			    			    programBreak = previousProgramBreak;
-					    }
-					    else
-					    {
-			    			    *(uint64_t *)previousProgramBreak = (uint64_t)(programBreak - previousProgramBreak) - 24;
-			    			    insert_block_into_freelist(previousProgramBreak + 24);
-			    			    newBlockPtr = find_best_fit_block(newSize);
-					    }
-		    		    }
-		    		    // Copy the contents from the old block to the new block
-                                    newBlockPtr = memcpy(newBlockPtr, originalPtr, currentBlockSize);
-		    		    HmmFree(originalPtr);
-			    }
-	    	    }
-	    	    else if ((originalPtr + 24 + currentBlockSize) == newBlockPtr)
-	    	    {
-			    // Extend the current block if possible
-                            *(uint64_t *)(originalPtr - 24) = newSize + 24;
-			    newBlockPtr = originalPtr;
-	    	    }
-	    	    else
-	    	    {
-			    // Free the newly found block and allocate additional memory
-                            HmmFree(newBlockPtr);
-			    previousProgramBreak = programBreak;
-			    programBreak = (char *)increase_program_break(PAGE_SIZE);
-            
-			    if (programBreak == NULL)
-			    {
-		    		    newBlockPtr = NULL;
-		    		    programBreak = previousProgramBreak;
-			    }
-			    else
-			    {
-		    		    *(uint64_t *)previousProgramBreak = (uint64_t)(programBreak - previousProgramBreak) - 24;
-		    		    insert_block_into_freelist(previousProgramBreak + 24);
-		    		    newBlockPtr = find_best_fit_block(newSize);
-		    		    while ((newBlockPtr-24) == NULL)
-		    		    {
-					    previousProgramBreak = programBreak;
-					    programBreak = (char *)increase_program_break(PAGE_SIZE); 
-					    if (programBreak == NULL)
-					    {
-			    			    newBlockPtr = NULL;
-			    			    programBreak = previousProgramBreak;
-					    }
-					    else
-					    {
-			    			    *(uint64_t *)previousProgramBreak = (uint64_t)(programBreak - previousProgramBreak) - 24;
-			    			    insert_block_into_freelist(previousProgramBreak + 24);
-			    			    newBlockPtr = find_best_fit_block(newSize);
-					    }
-		    		    }
-		    		    newBlockPtr = memcpy(newBlockPtr, originalPtr, currentBlockSize);
-		    		    HmmFree(originalPtr);
-			    }
-	    	    }
-	    }
-	    else
-	    {
-	    	    // Handle case where the new size is smaller than or equal to the current size
-                    if (newSize < 24)
-	    	    {
-			    newSize = 24;
-	    	    }
-        
-	    	    // Align the new size to the nearest multiple of the word size
-		    newSize = (newSize + word_size - 1) & ~(word_size - 1);
-
-	    	    freeSpaceSize = currentBlockSize - newSize;
-	    	    if (freeSpaceSize <= 24)
-	    	    {
-			    newBlockPtr = originalPtr;
-	    	    }
-	    	    else
-	    	    {
-			    // Adjust the free space size to be a multiple of the word size
-                            freeSpaceSize = (freeSpaceSize + word_size - 1) & ~(word_size - 1);
-			    *(uint64_t *)(originalPtr - 24) = newSize;
-			    *(uint64_t *)(originalPtr + newSize) = freeSpaceSize - 24;
-			    HmmFree(originalPtr + newSize + 24);
-			    newBlockPtr = originalPtr;
-	    	    }
-	    }
+        currentBlockSize = node->length;
+
+        // Adjust the new size the same way HmmAlloc adjusts a request
+        if (newSize < tuneConfig.minBlockSize)
+        {
+            newSize = tuneConfig.minBlockSize;
+        }
+        newSize = (newSize + tuneConfig.roundingSize - 1) & ~(tuneConfig.roundingSize - 1);
+
+        // Grow in place by taking in the following block, if it is free and the two together are large enough
+        nextNode = (FreeListNode *)(originalPtr + currentBlockSize);
+        if (newSize > currentBlockSize && (char *)nextNode < programBreak && BLOCK_IS_FREE(nextNode) &&
+            currentBlockSize + sizeof(FreeListNode) + nextNode->length >= newSize)
+        {
+            remove_freelist_node(nextNode);
+            node->length = currentBlockSize + sizeof(FreeListNode) + nextNode->length;
+            if (compactResume == nextNode)
+            {
+                compactResume = node;
+            }
+            currentBlockSize = node->length;
+        }
+
+        if (newSize > currentBlockSize)
+        {
+            // Move the contents to a block that is large enough
+            newBlockPtr = HmmAlloc(newSize);
+            if (newBlockPtr != NULL)
+            {
+                HMM_STATS_COUNT(HMM_EVENT_REALLOC_COPY);
+                memcpy(newBlockPtr, originalPtr, currentBlockSize);
+                HmmFree(originalPtr);
+            }
+        }
+        else
+        {
+            // Resize in place, and free the rest if it is large enough to be a free block
+            HMM_STATS_COUNT(HMM_EVENT_REALLOC_IN_PLACE);
+            if (currentBlockSize - newSize >= sizeof(FreeListNode) + FREE_NODE_MIN_LENGTH)
+            {
+                node->length = newSize;
+                tailNode = (FreeListNode *)(originalPtr + newSize);
+                tailNode->length = currentBlockSize - newSize - sizeof(FreeListNode);
+                tailNode->prev = BLOCK_IN_USE;
+                tailNode->next = NULL;
+                HmmFree((void *)tailNode + sizeof(FreeListNode));
+            }
+            newBlockPtr = originalPtr;
+        }
     }
+
+    heap_unlock(locked);
+    HMM_PROBE3(realloc, originalPtr, newSize, newBlockPtr);
+    HMM_STATS_TIMER_STOP(HMM_OP_REALLOC, startCycles);
     return newBlockPtr;
 }
 
 /**
  * @brief Increases the program break by a specified increment.
  *
- * This function increases the program's data space by the specified increment using the `sbrk` system call.
+ * This function increases the program's data space by the specified increment using the `sbrk` system call,
+ * or grows the active region when a mapped heap is in use.
  * It returns the new program break address after the increment. If the memory allocation fails, it returns `NULL`.
+ * Like increase_region_break, it only reports memory to HmmCalloc as zero if it was never used before or lies in
+ * a page that was handed back to the kernel when the break was lowered.
  *
  * @param increment The number of bytes to increase the program break by.
  * @return void* The new program break address, or `NULL` if the allocation fails.
  */
 void *increase_program_break(size_t increment)
 {
+    // A mapped heap grows inside its region instead of moving the real program break
+    if (activeRegion != NULL)
+    {
+        return increase_region_break(activeRegion, increment);
+    }
+
     void *current_break = sbrk(increment); // Attempt to increase the program break
+    char *zeroStart = NULL;                // Start of the part of the increment known to be zero
+    size_t pageSize = 0;
 
     // Check if the sbrk call was successful
     if (current_break == (void *)-1) {
         return NULL; // Return NULL if the memory allocation failed
     }
 
+    // Memory above the high-water mark comes straight from the kernel and is zero. Below it, lowering the break
+    // only gave back the pages above it; the rest of the page the break was in still holds old data.
+    if (breakHighWater == NULL)
+    {
+        breakHighWater = (char *)current_break;
+    }
+    zeroStart = (char *)current_break;
+    if (zeroStart < breakHighWater)
+    {
+        pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        zeroStart = (char *)(((uintptr_t)zeroStart + pageSize - 1) & ~(pageSize - 1));
+        if (zeroStart > breakHighWater)
+        {
+            zeroStart = breakHighWater;
+        }
+    }
+    if ((char *)current_break + increment > zeroStart)
+    {
+        mark_range_zeroed(zeroStart, (char *)current_break + increment - zeroStart);
+    }
+    if ((char *)current_break + increment > breakHighWater)
+    {
+        breakHighWater = (char *)current_break + increment;
+    }
+    if (increment > 0)
+    {
+        tuneEpochGrowths++;
+        HMM_STATS_COUNT(HMM_EVENT_BREAK_INCREASE);
+        HMM_PROBE1(sbrk, increment);
+    }
+
     // Get the new program break after the increment
     current_break = sbrk(0);
     return current_break;
@@ -411,7 +616,8 @@ void *increase_program_break(size_t increment)
 /**
  * @brief Decreases the program break by a specified decrement.
  *
- * This function decreases the program's data space by the specified decrement using the `sbrk` system call.
+ * This function decreases the program's data space by the specified decrement using the `sbrk` system call,
+ * or shrinks the active region when a mapped heap is in use.
  * It returns the new program break address after the decrement. If the memory deallocation fails, it returns `NULL`.
  *
  * @param decrement The number of bytes to decrease the program break by.
@@ -419,6 +625,12 @@ void *increase_program_break(size_t increment)
  */
 void *decrease_program_break(size_t decrement)
 {
+    // A mapped heap shrinks inside its region instead of moving the real program break
+    if (activeRegion != NULL)
+    {
+        return decrease_region_break(activeRegion, decrement);
+    }
+
     void *current_break = sbrk(-decrement); // Attempt to decrease the program break
 
     // Check if the sbrk call was successful
@@ -428,6 +640,237 @@ void *decrease_program_break(size_t decrement)
 
     // Get the new program break after the decrement
     current_break = sbrk(0);
+
+    // Memory above the new break is gone, so it can no longer be known to be zero
+    mark_range_dirty(current_break, decrement);
+    tuneEpochTrims++;
+    HMM_STATS_COUNT(HMM_EVENT_BREAK_DECREASE);
+    HMM_PROBE1(trim, decrement);
     return current_break;
 }
 
+
+/**
+ * @brief Grows the heap inside a mapped region.
+ *
+ * Works like `sbrk` on a fixed range of memory. Only bytes above the region's high-water mark are reported to
+ * HmmCalloc as zero, since lower bytes may still hold data from before an earlier decrease.
+ *
+ * @param region The region to grow.
+ * @param increment The number of bytes to grow by.
+ * @return void* The new end of the heap, or `NULL` if the region is full.
+ */
+void *increase_region_break(HeapRegion *region, size_t increment)
+{
+    if (increment > (size_t)(region->limit - region->current))
+    {
+        return NULL;
+    }
+
+    region->current += increment;
+    if (region->current > region->highWater)
+    {
+        mark_range_zeroed(region->highWater, region->current - region->highWater);
+        region->highWater = region->current;
+    }
+    if (increment > 0)
+    {
+        HMM_STATS_COUNT(HMM_EVENT_BREAK_INCREASE);
+    }
+
+    return region->current;
+}
+
+/**
+ * @brief Shrinks the heap inside a mapped region.
+ *
+ * @param region The region to shrink.
+ * @param decrement The number of bytes to shrink by.
+ * @return void* The new end of the heap, or `NULL` if that would move below the start of the region.
+ */
+void *decrease_region_break(HeapRegion *region, size_t decrement)
+{
+    if (decrement > (size_t)(region->current - region->base))
+    {
+        return NULL;
+    }
+
+    region->current -= decrement;
+    mark_range_dirty(region->current, decrement);
+    HMM_STATS_COUNT(HMM_EVENT_BREAK_DECREASE);
+
+    return region->current;
+}
+
+/**
+ * @brief Reads a byte count such as "64M" from an environment variable.
+ *
+ * @param name Name of the variable.
+ * @return size_t The byte count, or 0 if the variable is unset or not a number.
+ */
+static size_t read_size_env(const char *name)
+{
+    const char *value = getenv(name);
+    char *suffix = NULL;
+    size_t size = 0;
+
+    if (value == NULL)
+    {
+        return 0;
+    }
+
+    size = strtoull(value, &suffix, 10);
+    switch (*suffix)
+    {
+    case 'g': case 'G':
+        size <<= 10;
+        /* fall through */
+    case 'm': case 'M':
+        size <<= 10;
+        /* fall through */
+    case 'k': case 'K':
+        size <<= 10;
+        break;
+    default:
+        break;
+    }
+
+    return size;
+}
+
+/**
+ * @brief Faults in the pages of a range ahead of use.
+ *
+ * Uses MADV_POPULATE_WRITE where the kernel has it (Linux 5.14), otherwise writes each page back with its own
+ * value, which faults it in without changing the free list header or the zero contents of the range.
+ *
+ * @param start Start of the range.
+ * @param length Length of the range in bytes.
+ */
+static void prefault_range(char *start, size_t length)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    char *page = (char *)(((uintptr_t)start + pageSize - 1) & ~(pageSize - 1));
+    char *end = start + length;
+
+    // The partial pages at both ends are not covered by madvise and are written instead
+    if (page + pageSize <= end && madvise(page, (end - page) & ~(pageSize - 1), MADV_POPULATE_WRITE) == 0)
+    {
+        *(volatile char *)start = *(volatile char *)start;
+        *(volatile char *)(end - 1) = *(volatile char *)(end - 1);
+        return;
+    }
+
+    for (page = start; page < end; page += pageSize)
+    {
+        *(volatile char *)page = *(volatile char *)page;
+    }
+    *(volatile char *)(end - 1) = *(volatile char *)(end - 1);
+}
+
+/**
+ * @brief Grows the process heap ahead of time so early allocations do not pay for sbrk calls and page faults.
+ *
+ * The heap grows by `reserveBytes` in one step and the new space becomes a single free block, which small and
+ * large requests alike are split from. The heap is never trimmed below the reserve afterwards. The first
+ * `prefaultBytes` of it are faulted in right away. HmmReleaseFreeMemory still returns the pages of the reserve to
+ * the kernel while memory is under pressure.
+ *
+ * @param reserveBytes Number of bytes to add to the heap, rounded up to a whole growth step.
+ * @param prefaultBytes Number of bytes of the reserve to fault in now, at most `reserveBytes`.
+ * @return int 0 on success, -1 if a mapped heap is active or the heap cannot grow.
+ */
+int HmmReserve(size_t reserveBytes, size_t prefaultBytes)
+{
+    char *previousProgramBreak = NULL;
+    char *newProgramBreak = NULL;
+    uint8_t locked = 0;
+
+    if (activeRegion != NULL)
+    {
+        return -1;
+    }
+    if (reserveBytes == 0)
+    {
+        return 0;
+    }
+
+    locked = heap_lock();
+    if (programBreak == NULL)
+    {
+        programBreak = (char *)sbrk(0);
+        heapStart = programBreak;
+    }
+
+    reserveBytes = ((reserveBytes + tuneConfig.growthSize - 1) / tuneConfig.growthSize) * tuneConfig.growthSize;
+    previousProgramBreak = programBreak;
+    newProgramBreak = (char *)increase_program_break(reserveBytes);
+    if (newProgramBreak == NULL)
+    {
+        heap_unlock(locked);
+        return -1;
+    }
+    programBreak = newProgramBreak;
+    reservedBreak = programBreak;
+
+    insert_grown_block(previousProgramBreak);
+    heap_unlock(locked);
+
+    if (prefaultBytes > reserveBytes)
+    {
+        prefaultBytes = reserveBytes;
+    }
+    if (prefaultBytes > 0)
+    {
+        prefault_range(previousProgramBreak, prefaultBytes);
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Sets up the process heap when the library is loaded, before main runs.
+ *
+ * Records the initial program break so HmmAlloc does not have to check for initialisation on every call, and
+ * applies the HMM_RESERVE and HMM_PREFAULT environment variables (byte counts with an optional K, M or G suffix)
+ * through HmmReserve. HMM_TUNE is either "auto", to adapt the configuration to the workload, or a
+ * configuration written by HmmTuneExport, which is pinned. HMM_PROFILE (a sampling rate in bytes, with the same
+ * suffixes) starts the heap profiler, which writes its profile to files named after HMM_PROFILE_FILE at exit and
+ * whenever the signal numbered HMM_PROFILE_SIGNAL arrives.
+ */
+__attribute__((constructor)) static void heap_init(void)
+{
+    size_t reserveBytes = read_size_env("HMM_RESERVE");
+    size_t prefaultBytes = read_size_env("HMM_PREFAULT");
+    size_t profileRate = read_size_env("HMM_PROFILE");
+    const char *tuning = getenv("HMM_TUNE");
+
+    if (programBreak == NULL)
+    {
+        programBreak = (char *)sbrk(0);
+        heapStart = programBreak;
+    }
+
+    // Either adapt to the workload, or pin a configuration exported by an earlier run
+    if (tuning != NULL && strcmp(tuning, "auto") == 0)
+    {
+        HmmTuneStart();
+    }
+    else if (tuning != NULL)
+    {
+        HmmTuneImport(tuning);
+    }
+
+    // Profile a program that cannot call HmmProfileStart, such as one run with LD_PRELOAD
+    if (profileRate > 0)
+    {
+        profile_start_from_env(profileRate, getenv("HMM_PROFILE_FILE"), getenv("HMM_PROFILE_SIGNAL"));
+    }
+
+    // Prefaulting more than the reserve implies reserving that much
+    if (prefaultBytes > reserveBytes)
+    {
+        reserveBytes = prefaultBytes;
+    }
+    HmmReserve(reserveBytes, prefaultBytes);
+}
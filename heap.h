@@ -1,15 +1,36 @@
 #ifndef HEAP
 #define HEAP
+
+// Define the HeapRegion structure: a fixed memory range that stands in for the sbrk heap
+typedef struct HeapRegion {
+    char *base;      // First byte of the region
+    char *limit;     // One past the last byte the heap may grow into
+    char *current;   // Current end of the heap inside the region
+    char *highWater; // Bytes at or above this address have never been handed out and are still zero
+} HeapRegion;
+
+// Region the program break functions operate on, NULL for the process heap managed with sbrk
+extern HeapRegion *activeRegion;
+
+// End of the memory reserved by HmmReserve; the process heap is never trimmed below it
+extern char *reservedBreak;
+
 void *malloc(size_t size);
 void free(void *ptr);
 void *calloc(size_t nmemb, size_t size);
 void *realloc(void *ptr, size_t size);
 void *HmmAlloc(size_t size);
 void HmmFree(void *ptr);
+void trim_program_break(void);
+size_t release_free_top(void);
 void *HmmCalloc(size_t nmemb, size_t size);
 void *HmmRealloc(void *ptr, size_t size);
+size_t calculate_growth_size(size_t requestedSize);
 void *increase_program_break(size_t increment);
 void *decrease_program_break(size_t decrement);
+void *increase_region_break(HeapRegion *region, size_t increment);
+void *decrease_region_break(HeapRegion *region, size_t decrement);
+int HmmReserve(size_t reserveBytes, size_t prefaultBytes);
 #endif
 
 
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Builds each test program together with the library sources and runs it.
+#
+# usage: tests/run_tests.sh [test_name ...]
+# CFLAGS replaces the default optimisation flags, e.g. CFLAGS=-O0 tests/run_tests.sh test_alloc
+
+cd "$(dirname "$0")/.." || exit 1
+build_dir=${BUILD_DIR:-/tmp/hmm-tests}
+mkdir -p "$build_dir" || exit 1
+
+if [ $# -eq 0 ]; then
+    set -- $(ls tests/test_*.c | sed 's|tests/||; s|\.c$||')
+fi
+
+failed=0
+for name in "$@"; do
+    # Tests of the statistics need the instrumentation compiled in
+    case $name in
+        test_stats|test_reclaim) extra=-DHMM_STATS ;;
+        *) extra= ;;
+    esac
+
+    if ! gcc ${CFLAGS:--O2 -g} -Wall -Wno-pointer-arith $extra -o "$build_dir/$name" "tests/$name.c" \
+        heap.c FreeList.c Profiler.c Stats.c Handle.c Persistent.c SharedHeap.c Pressure.c Tune.c Reclaim.c \
+        -pthread -lrt; then
+        echo "$name: build failed"
+        failed=1
+        continue
+    fi
+
+    if ! (cd "$build_dir" && "./$name"); then
+        echo "$name: FAILED"
+        failed=1
+    fi
+done
+
+exit $failed
@@ -0,0 +1,82 @@
+#ifndef HMM_TEST
+#define HMM_TEST
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../heap.h"
+#include "../FreeList.h"
+
+/*
+ * Minimal checks for the test programs in this directory. A failed check reports its location on stderr and
+ * ends the test with a non-zero status. Messages go through stderr, which is unbuffered and never allocates.
+ */
+#define CHECK(condition)                                                                    \
+    do                                                                                      \
+    {                                                                                       \
+        if (!(condition))                                                                   \
+        {                                                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition);   \
+            exit(1);                                                                        \
+        }                                                                                   \
+    } while (0)
+
+extern FreeListNode *FreeListHead;
+extern char *programBreak;
+extern char *heapStart;
+
+/*
+ * Walks every block of the process heap from `heapStart` to the program break and checks the boundary tags against
+ * the free list: lengths are whole words, free blocks are never adjacent, a block that is not free names the free
+ * block before it, the tail is the free block at the break, and the list holds each free block exactly once.
+ * Returns the number of free blocks.
+ */
+static inline uint64_t check_heap(void)
+{
+    FreeListNode *block = (FreeListNode *)heapStart;
+    FreeListNode *previous = NULL;
+    FreeListNode *node = NULL;
+    uint64_t freeBlocks = 0;
+    uint64_t listed = 0;
+
+    while (block != NULL && (char *)block < programBreak)
+    {
+        CHECK(block->length >= FREE_NODE_MIN_LENGTH && (block->length & 7) == 0);
+        if (BLOCK_IS_FREE(block))
+        {
+            CHECK(previous == NULL || !BLOCK_IS_FREE(previous));
+            freeBlocks++;
+        }
+        else
+        {
+            CHECK(block->next == ((previous != NULL && BLOCK_IS_FREE(previous)) ? previous : NULL));
+        }
+        previous = block;
+        block = (FreeListNode *)((char *)block + sizeof(FreeListNode) + block->length);
+    }
+    CHECK(block == NULL || (char *)block == programBreak);
+    CHECK(freeBinIndex->tail == ((previous != NULL && BLOCK_IS_FREE(previous)) ? previous : NULL));
+
+    for (node = FreeListHead, previous = NULL; node != NULL && listed <= freeBlocks; previous = node, node = node->next)
+    {
+        CHECK(BLOCK_IS_FREE(node) && node->prev == previous);
+        listed++;
+    }
+    CHECK(listed == freeBlocks);
+
+    return freeBlocks;
+}
+
+// Counts the bytes of a block that are not zero
+static inline size_t count_nonzero(const unsigned char *block, size_t size)
+{
+    size_t count = 0;
+    size_t i = 0;
+
+    for (i = 0; i < size; i++)
+    {
+        count += (block[i] != 0);
+    }
+    return count;
+}
+
+#endif
@@ -0,0 +1,117 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+#include "../heap.h"
+
+#define SLOTS 1024
+#define ITERATIONS 100000
+
+/* Fills a block with a pattern derived from its slot, so an overlap with another block is noticed */
+static void fill(unsigned char *block, size_t size, uint32_t slot)
+{
+    memset(block, (int)(slot & 0xff), size);
+}
+
+static int intact(const unsigned char *block, size_t size, uint32_t slot)
+{
+    size_t i = 0;
+
+    for (i = 0; i < size; i++)
+    {
+        if (block[i] != (unsigned char)(slot & 0xff))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static size_t random_size(void)
+{
+    // Mostly small blocks, some large enough to grow and trim the heap
+    return (rand() % 16 == 0) ? (size_t)(rand() % (512 * 1024)) + 1 : (size_t)(rand() % 512) + 1;
+}
+
+int main(void)
+{
+    static unsigned char *blocks[SLOTS];
+    static size_t sizes[SLOTS];
+    uint32_t i = 0;
+    uint32_t slot = 0;
+    unsigned char *first = NULL;
+    unsigned char *hole = NULL;
+    unsigned char *last = NULL;
+    unsigned char *moved = NULL;
+    char *heapStart = sbrk(0);
+
+    srand(26);
+    for (i = 0; i < ITERATIONS; i++)
+    {
+        slot = (uint32_t)rand() % SLOTS;
+        if (blocks[slot] == NULL)
+        {
+            sizes[slot] = random_size();
+            blocks[slot] = HmmAlloc(sizes[slot]);
+            CHECK(blocks[slot] != NULL);
+            CHECK(((uintptr_t)blocks[slot] & 7) == 0);
+            fill(blocks[slot], sizes[slot], slot);
+        }
+        else if (rand() % 4 == 0)
+        {
+            // Grow or shrink; the old contents must survive up to the smaller size
+            size_t newSize = random_size();
+            size_t kept = (newSize < sizes[slot]) ? newSize : sizes[slot];
+
+            CHECK(intact(blocks[slot], sizes[slot], slot));
+            blocks[slot] = HmmRealloc(blocks[slot], newSize);
+            CHECK(blocks[slot] != NULL);
+            CHECK(intact(blocks[slot], kept, slot));
+            sizes[slot] = newSize;
+            fill(blocks[slot], sizes[slot], slot);
+        }
+        else
+        {
+            CHECK(intact(blocks[slot], sizes[slot], slot));
+            HmmFree(blocks[slot]);
+            blocks[slot] = NULL;
+        }
+    }
+
+    for (slot = 0; slot < SLOTS; slot++)
+    {
+        if (blocks[slot] != NULL)
+        {
+            CHECK(intact(blocks[slot], sizes[slot], slot));
+            HmmFree(blocks[slot]);
+        }
+    }
+
+    // A block grows in place into the free block after it, and moves once the block after it is in use
+    first = HmmAlloc(100);
+    hole = HmmAlloc(1000);
+    last = HmmAlloc(100);
+    HmmFree(hole);
+    fill(first, 100, 1);
+    CHECK(HmmRealloc(first, 600) == first && intact(first, 100, 1));
+    CHECK(HmmRealloc(first, 104 + 24 + 1000) == first && intact(first, 100, 1));
+    moved = HmmRealloc(first, 2000);
+    CHECK(moved != NULL && moved != first && intact(moved, 100, 1));
+
+    // Sizes that would wrap when rounded fail and leave the block alone, and a size of zero frees it
+    CHECK(HmmRealloc(moved, (size_t)PTRDIFF_MAX + 1) == NULL && intact(moved, 100, 1));
+    first = HmmAlloc(200);
+    hole = HmmAlloc(200);
+    CHECK(HmmRealloc(first, 0) == NULL);
+    CHECK(HmmAlloc(200) == first);
+    HmmFree(first);
+    HmmFree(hole);
+    HmmFree(moved);
+    HmmFree(last);
+
+    // With everything freed, the heap has been trimmed back to less than one trim chunk above where it started
+    CHECK((char *)sbrk(0) - heapStart <= 256 * 1024);
+
+    printf("test_alloc: ok\n");
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+#include "../heap.h"
+
+#define BIG (300 * 1000)
+
+int main(void)
+{
+    unsigned char *small = NULL;
+    unsigned char *block = NULL;
+    unsigned char *other = NULL;
+    volatile size_t hugeSize = SIZE_MAX; // Keeps the compiler from folding the huge requests away
+
+    // Fresh memory from the program break needs no clearing, but must still read as zero
+    block = HmmCalloc(1, BIG);
+    CHECK(block != NULL);
+    CHECK(count_nonzero(block, BIG) == 0);
+    memset(block, 0xab, BIG);
+    HmmFree(block);
+
+    // A reused block in the middle of the heap has to be cleared
+    small = HmmAlloc(100);
+    block = HmmAlloc(4096);
+    other = HmmAlloc(100);
+    memset(block, 0xab, 4096);
+    HmmFree(block);
+    block = HmmCalloc(64, 64);
+    CHECK(block != NULL);
+    CHECK(count_nonzero(block, 4096) == 0);
+    HmmFree(block);
+    HmmFree(other);
+
+    // Lowering the break into the middle of a page keeps the rest of that page; growing back over it must not
+    // report those bytes as zero
+    block = HmmAlloc(BIG);
+    memset(block, 0xab, BIG);
+    HmmFree(block);
+    release_free_top();
+    block = HmmCalloc(1, BIG);
+    CHECK(block != NULL);
+    CHECK(count_nonzero(block, BIG) == 0);
+    HmmFree(block);
+
+    // Overflowing sizes are rejected, including sizes that would wrap when rounded or given a header
+    CHECK(HmmCalloc(SIZE_MAX / 2, 4) == NULL);
+    CHECK(calloc(1, hugeSize) == NULL);
+    CHECK(malloc(hugeSize) == NULL);
+    CHECK(HmmAlloc(SIZE_MAX - 30) == NULL);
+    CHECK(HmmAlloc((size_t)PTRDIFF_MAX + 1) == NULL);
+
+    HmmFree(small);
+    printf("test_calloc: ok\n");
+    return 0;
+}
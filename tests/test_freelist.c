@@ -0,0 +1,92 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "test.h"
+#include "../heap.h"
+#include "../FreeList.h"
+
+#define BLOCKS 4096
+
+int main(void)
+{
+    static char *blocks[BLOCKS];
+    uint32_t order[BLOCKS];
+    uint32_t i = 0;
+
+    srand(7);
+
+    // Lay out blocks of mixed sizes
+    for (i = 0; i < BLOCKS; i++)
+    {
+        blocks[i] = HmmAlloc(16 + (rand() % 64) * 8);
+        CHECK(blocks[i] != NULL);
+        memset(blocks[i], (int)i, 16);
+    }
+    check_heap();
+
+    // Freeing every other block leaves holes that cannot merge
+    for (i = 0; i < BLOCKS; i += 2)
+    {
+        HmmFree(blocks[i]);
+    }
+    CHECK(check_heap() >= BLOCKS / 2);
+
+    // Freeing the rest in random order merges the holes with blocks on both sides
+    for (i = 0; i < BLOCKS / 2; i++)
+    {
+        order[i] = 2 * i + 1;
+    }
+    for (i = BLOCKS / 2 - 1; i > 0; i--)
+    {
+        uint32_t j = rand() % (i + 1);
+        uint32_t swap = order[i];
+        order[i] = order[j];
+        order[j] = swap;
+    }
+    for (i = 0; i < BLOCKS / 2; i++)
+    {
+        CHECK(blocks[order[i]][0] == (char)order[i]);
+        HmmFree(blocks[order[i]]);
+        if (i % 256 == 0)
+        {
+            check_heap();
+        }
+    }
+    CHECK(check_heap() <= 1);
+
+    // Splitting, shrinking in place and growing keep the tags consistent
+    for (i = 0; i < BLOCKS; i++)
+    {
+        blocks[i] = HmmAlloc(8 + (rand() % 512) * 8);
+        CHECK(blocks[i] != NULL);
+    }
+    for (i = 0; i < BLOCKS; i++)
+    {
+        switch (rand() % 3)
+        {
+        case 0:
+            HmmFree(blocks[i]);
+            blocks[i] = NULL;
+            break;
+        case 1:
+            blocks[i] = HmmRealloc(blocks[i], 8);
+            break;
+        default:
+            blocks[i] = HmmRealloc(blocks[i], 8192);
+            break;
+        }
+    }
+    check_heap();
+    for (i = 0; i < BLOCKS; i++)
+    {
+        if (blocks[i] != NULL)
+        {
+            HmmFree(blocks[i]);
+        }
+    }
+    CHECK(check_heap() <= 1);
+
+    printf("test_freelist: ok\n");
+    return 0;
+}
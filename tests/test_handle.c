@@ -0,0 +1,120 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "../heap.h"
+#include "../FreeList.h"
+#include "../Handle.h"
+
+#define HANDLES 1000
+#define HANDLE_SIZE 1000
+#define PLAIN_BLOCKS 4000
+
+static HmmHandle handles[HANDLES];
+static void *plain[PLAIN_BLOCKS];
+
+// Checks that every live handle still holds the byte pattern it was filled with
+static void check_contents(void)
+{
+    uint32_t i = 0;
+    uint32_t j = 0;
+
+    for (i = 0; i < HANDLES; i++)
+    {
+        unsigned char *data = NULL;
+
+        if (handles[i] == 0)
+        {
+            continue;
+        }
+        data = HmmHandleLock(handles[i]);
+        CHECK(data != NULL);
+        for (j = 0; j < HANDLE_SIZE; j++)
+        {
+            CHECK(data[j] == (unsigned char)i);
+        }
+        HmmHandleUnlock(handles[i]);
+    }
+}
+
+int main(void)
+{
+    char *breakBefore = NULL;
+    void *pinned = NULL;
+    size_t moved = 0;
+    uint32_t holesBefore = 0;
+    uint32_t steps = 0;
+    uint32_t i = 0;
+
+    // Fill the heap with handle blocks, then free every other one so that the holes cannot merge
+    for (i = 0; i < HANDLES; i++)
+    {
+        handles[i] = HmmHandleAlloc(HANDLE_SIZE);
+        CHECK(handles[i] != 0);
+        memset(HmmHandleLock(handles[i]), (int)i, HANDLE_SIZE);
+        HmmHandleUnlock(handles[i]);
+    }
+    for (i = 0; i < HANDLES; i += 2)
+    {
+        HmmHandleFree(handles[i]);
+        handles[i] = 0;
+    }
+    holesBefore = check_heap();
+    CHECK(holesBefore >= HANDLES / 2);
+    breakBefore = programBreak;
+
+    // A locked block is never moved, even though a hole lies right below it
+    pinned = HmmHandleLock(handles[1]);
+
+    // A budget of one byte looks at a single block, or moves a single block, and stops right after it
+    moved = HmmCompact(1);
+    CHECK(moved == COMPACT_VISIT_COST || (moved > HANDLE_SIZE && moved <= HANDLE_SIZE + 64));
+    check_heap();
+
+    // Repeated steps close every hole below an unlocked block, and the freed space at the top goes back
+    while ((moved = HmmCompact(64 * 1024)) > 0)
+    {
+        CHECK(++steps < 100);
+        check_heap();
+    }
+    CHECK(steps > 1);
+    CHECK(check_heap() < holesBefore / 10);
+    CHECK(programBreak < breakBefore);
+    CHECK(HmmHandleLock(handles[1]) == pinned);
+    HmmHandleUnlock(handles[1]);
+    HmmHandleUnlock(handles[1]);
+    check_contents();
+
+    // Invalid handles are ignored, and a freed handle is recycled
+    CHECK(HmmHandleLock(0) == NULL && HmmHandleLock(HANDLE_MAX) == NULL);
+    HmmHandleFree(0);
+    HmmHandleUnlock(0);
+    HmmHandleFree(handles[3]);
+    CHECK(HmmHandleLock(handles[3]) == NULL);
+    CHECK(HmmHandleAlloc(HANDLE_SIZE) == handles[3]);
+    handles[3] = 0;
+    check_contents();
+
+    // Holes between ordinary blocks cannot be closed, and a step only walks as many blocks as its budget pays for
+    for (i = 0; i < PLAIN_BLOCKS; i++)
+    {
+        plain[i] = HmmAlloc(HANDLE_SIZE);
+        CHECK(plain[i] != NULL);
+    }
+    for (i = 0; i < PLAIN_BLOCKS; i += 2)
+    {
+        HmmFree(plain[i]);
+    }
+    steps = 0;
+    while ((moved = HmmCompact(COMPACT_VISIT_COST * 16)) > 0)
+    {
+        CHECK(moved < COMPACT_VISIT_COST * 16 + HANDLE_SIZE + 64);
+        CHECK(++steps < PLAIN_BLOCKS);
+    }
+    CHECK(steps >= PLAIN_BLOCKS / 32);
+    check_heap();
+    check_contents();
+
+    printf("test_handle: ok\n");
+    return 0;
+}
@@ -0,0 +1,157 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "test.h"
+#include "../heap.h"
+#include "../FreeList.h"
+#include "../Persistent.h"
+
+#define BASE ((void *)0x6f0000000000)
+#define CAPACITY (4 << 20)
+#define ITEMS 64
+
+// Root object kept in the heap file
+typedef struct Index {
+    uint64_t count;
+    uint64_t *items[ITEMS];
+} Index;
+
+static char path[64];
+
+// Overwrites `length` bytes of the closed heap file at the address they are mapped at
+static void patch_file(void *address, const void *bytes, size_t length)
+{
+    int fd = open(path, O_RDWR);
+
+    CHECK(fd >= 0);
+    CHECK(pwrite(fd, bytes, length, (char *)address - (char *)BASE) == (ssize_t)length);
+    close(fd);
+}
+
+// Reads `length` bytes of the closed heap file
+static void read_file(void *address, void *bytes, size_t length)
+{
+    int fd = open(path, O_RDONLY);
+
+    CHECK(fd >= 0);
+    CHECK(pread(fd, bytes, length, (char *)address - (char *)BASE) == (ssize_t)length);
+    close(fd);
+}
+
+int main(void)
+{
+    Index *index = NULL;
+    FreeListNode header;
+    FreeListNode saved;
+    uint64_t badLength = 0;
+    uint64_t byte = 0;
+    pid_t child = 0;
+    int status = 0;
+    uint64_t i = 0;
+
+    snprintf(path, sizeof(path), "/tmp/hmm-test-%d.heap", (int)getpid());
+    unlink(path);
+
+    // A new heap file is created at the requested address and keeps its contents and root across a reopen
+    CHECK(HmmPersistentOpen(path, CAPACITY, BASE) == 0);
+    CHECK(HmmPersistentGetRoot() == NULL);
+    index = HmmPersistentCalloc(1, sizeof(Index));
+    CHECK(index != NULL && (void *)index > BASE && (char *)index < (char *)BASE + CAPACITY);
+    for (i = 0; i < ITEMS; i++)
+    {
+        index->items[i] = HmmPersistentAlloc(16 + i * 24);
+        CHECK(index->items[i] != NULL);
+        index->items[i][0] = i * 1000;
+    }
+    for (i = 0; i < ITEMS; i += 3)
+    {
+        HmmPersistentFree(index->items[i]);
+        index->items[i] = NULL;
+    }
+    index->count = ITEMS;
+    HmmPersistentSetRoot(index);
+    CHECK(HmmPersistentOpen(path, CAPACITY, BASE) == -1);
+    CHECK(HmmPersistentClose() == 0);
+    CHECK(HmmPersistentClose() == -1);
+
+    CHECK(HmmPersistentOpen(path, 0, NULL) == 0);
+    index = HmmPersistentGetRoot();
+    CHECK(index != NULL && index->count == ITEMS);
+    for (i = 0; i < ITEMS; i++)
+    {
+        CHECK(i % 3 == 0 ? index->items[i] == NULL : index->items[i][0] == i * 1000);
+    }
+
+    // The heap keeps working after a reopen; freed space is reused and grown blocks keep their contents
+    index->items[0] = HmmPersistentAlloc(64);
+    CHECK(index->items[0] != NULL);
+    index->items[1] = HmmPersistentRealloc(index->items[1], 4096);
+    CHECK(index->items[1] != NULL && index->items[1][0] == 1000);
+    CHECK(HmmPersistentClose() == 0);
+
+    // A process that dies with the heap open leaves a file that is recovered, and reported as such
+    child = fork();
+    CHECK(child >= 0);
+    if (child == 0)
+    {
+        if (HmmPersistentOpen(path, 0, NULL) != 0 || HmmPersistentAlloc(100) == NULL)
+        {
+            _exit(1);
+        }
+        _exit(0);
+    }
+    CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(HmmPersistentOpen(path, 0, NULL) == 1);
+    index = HmmPersistentGetRoot();
+    CHECK(index->items[1][0] == 1000);
+    CHECK(HmmPersistentClose() == 0);
+    CHECK(HmmPersistentOpen(path, 0, NULL) == 0);
+    CHECK(HmmPersistentClose() == 0);
+
+    // A header changed behind the allocator's back fails the checksum
+    read_file((char *)BASE + offsetof(PersistentHeader, root), &byte, 1);
+    byte ^= 0x40;
+    patch_file((char *)BASE + offsetof(PersistentHeader, root), &byte, 1);
+    CHECK(HmmPersistentOpen(path, 0, NULL) == -1);
+    byte ^= 0x40;
+    patch_file((char *)BASE + offsetof(PersistentHeader, root), &byte, 1);
+    CHECK(HmmPersistentOpen(path, 0, NULL) == 0);
+    index = HmmPersistentGetRoot();
+    CHECK(HmmPersistentClose() == 0);
+
+    // Block headers are not covered by the checksum, but a corrupted allocated block is still found
+    read_file((char *)index - sizeof(FreeListNode), &saved, sizeof(saved));
+    CHECK(saved.prev == BLOCK_IN_USE);
+    badLength = saved.length + 12;
+    patch_file((char *)index - sizeof(FreeListNode), &badLength, sizeof(badLength));
+    CHECK(HmmPersistentOpen(path, 0, NULL) == -1);
+
+    header = saved;
+    header.length = 1ULL << 40;
+    patch_file((char *)index - sizeof(FreeListNode), &header, sizeof(header));
+    CHECK(HmmPersistentOpen(path, 0, NULL) == -1);
+
+    header = saved;
+    header.next = (FreeListNode *)((char *)index + 64);
+    patch_file((char *)index - sizeof(FreeListNode), &header, sizeof(header));
+    CHECK(HmmPersistentOpen(path, 0, NULL) == -1);
+
+    // An allocated block that claims to be free is not in the free list
+    header = saved;
+    header.prev = NULL;
+    patch_file((char *)index - sizeof(FreeListNode), &header, sizeof(header));
+    CHECK(HmmPersistentOpen(path, 0, NULL) == -1);
+
+    patch_file((char *)index - sizeof(FreeListNode), &saved, sizeof(saved));
+    CHECK(HmmPersistentOpen(path, 0, NULL) == 0);
+    CHECK(HmmPersistentGetRoot() == index && index->items[2][0] == 2000);
+    CHECK(HmmPersistentClose() == 0);
+
+    unlink(path);
+    printf("test_persistent: ok\n");
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "test.h"
+#include "../heap.h"
+#include "../Pressure.h"
+
+static char cgroupDir[] = "/tmp/hmm-pressure-XXXXXX";
+static char path[256];
+static int callbackPressure = 0;
+
+/* Writes a value into one of the fake cgroup files */
+static void write_cgroup_file(const char *name, const char *value)
+{
+    int fd = -1;
+
+    snprintf(path, sizeof(path), "%s/%s", cgroupDir, name);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    CHECK(fd >= 0);
+    CHECK(write(fd, value, strlen(value)) == (ssize_t)strlen(value));
+    close(fd);
+}
+
+static int pressure_callback(void *context)
+{
+    return *(int *)context;
+}
+
+static int page_aligned(void *address)
+{
+    return ((uintptr_t)address & ((uintptr_t)sysconf(_SC_PAGESIZE) - 1)) == 0;
+}
+
+int main(void)
+{
+    unsigned char *small = NULL;
+    unsigned char *block = NULL;
+    unsigned char *hole = NULL;
+    char *breakBefore = NULL;
+    char trigger[64];
+    ssize_t length = 0;
+    int fd = -1;
+
+    CHECK(mkdtemp(cgroupDir) != NULL);
+    HmmPressureSetInterval(0);
+
+    // cgroup source: hysteresis between the high and the low threshold
+    CHECK(HmmPressureWatchCgroup("/nonexistent", 90, 80) == -1);
+    write_cgroup_file("memory.current", "50\n");
+    write_cgroup_file("memory.max", "100\n");
+    CHECK(HmmPressureWatchCgroup(cgroupDir, 90, 80) == 0);
+    CHECK(HmmPressureCheck() == 0);
+    write_cgroup_file("memory.current", "95\n");
+    CHECK(HmmPressureCheck() == 1);
+    write_cgroup_file("memory.current", "85\n");
+    CHECK(HmmPressureCheck() == 1);
+    write_cgroup_file("memory.current", "70\n");
+    CHECK(HmmPressureCheck() == 0);
+    write_cgroup_file("memory.max", "max\n");
+    write_cgroup_file("memory.current", "95\n");
+    CHECK(HmmPressureCheck() == 0);
+
+    // Under pressure, freeing the top block gives it all back, ending the heap on a page boundary
+    small = HmmAlloc(100);
+    breakBefore = sbrk(0);
+    block = HmmAlloc(1024 * 1024);
+    CHECK((char *)sbrk(0) > breakBefore);
+    write_cgroup_file("memory.max", "100\n");
+    CHECK(HmmPressureCheck() == 1);
+    HmmFree(block);
+    CHECK(page_aligned(sbrk(0)));
+    CHECK((char *)sbrk(0) <= breakBefore + sysconf(_SC_PAGESIZE));
+
+    // An allocation-only workload notices pressure too, when the heap grows
+    write_cgroup_file("memory.current", "10\n");
+    CHECK(HmmPressureCheck() == 0);
+    write_cgroup_file("memory.current", "99\n");
+    block = HmmAlloc(4 * 1024 * 1024);
+    CHECK(memoryPressure == 1);
+    HmmFree(block);
+
+    // Free pages in the middle of the heap are released too
+    write_cgroup_file("memory.current", "10\n");
+    CHECK(HmmPressureCheck() == 0);
+    hole = HmmAlloc(1024 * 1024);
+    block = HmmAlloc(100);
+    memset(hole, 0xab, 1024 * 1024);
+    HmmFree(hole);
+    CHECK(HmmReleaseFreeMemory() >= 1024 * 1024 - 2 * (size_t)sysconf(_SC_PAGESIZE));
+    HmmFree(block);
+    HmmPressureStop();
+
+    // Memory given back under pressure and grown over again is zero for calloc
+    HmmPressureWatchCallback(pressure_callback, &callbackPressure);
+    block = HmmAlloc(300000);
+    memset(block, 0xab, 300000);
+    callbackPressure = 1;
+    CHECK(HmmPressureCheck() == 1);
+    HmmFree(block);
+    callbackPressure = 0;
+    CHECK(HmmPressureCheck() == 0);
+    block = HmmCalloc(1, 300000);
+    CHECK(block != NULL);
+    CHECK(count_nonzero(block, 300000) == 0);
+    HmmFree(block);
+    HmmPressureStop();
+
+    // PSI source: the trigger is registered by writing it to the file; a regular file never fires
+    write_cgroup_file("memory.psi", "");
+    CHECK(HmmPressureWatchPsi(path, 150000, 1000000) == 0);
+    fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    length = read(fd, trigger, sizeof(trigger) - 1);
+    close(fd);
+    CHECK(length > 0);
+    trigger[length] = '\0';
+    CHECK(strcmp(trigger, "some 150000 1000000") == 0);
+    CHECK(HmmPressureCheck() == 0);
+    HmmPressureStop();
+    CHECK(HmmPressureWatchPsi("/nonexistent/memory", 150000, 1000000) == -1);
+
+    HmmFree(small);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/memory.current", cgroupDir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/memory.max", cgroupDir);
+    unlink(path);
+    rmdir(cgroupDir);
+
+    printf("test_pressure: ok\n");
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "test.h"
+#include "../heap.h"
+#include "../Profiler.h"
+
+#define BLOCKS 20000
+#define BLOCK_SIZE 512
+#define SAMPLE_RATE 4096
+#define EMPTY_HEADER "heap profile: 0: 0 [0: 0] @ heap_v2/1\n"
+
+static char dump[1 << 20];
+static char *blocks[BLOCKS];
+
+// Allocates through the malloc wrapper, so the allocations are seen by the profiler from a known function
+__attribute__((noinline)) static void *allocate_tracked(size_t size)
+{
+    void *block = malloc(size);
+
+    __asm__ volatile("" ::: "memory");
+    return block;
+}
+
+// Writes a profile into a temporary file and reads it back into `dump`
+static size_t dump_profile(uint8_t format)
+{
+    char path[] = "/tmp/hmm-profile-XXXXXX";
+    int fd = mkstemp(path);
+    ssize_t length = 0;
+
+    CHECK(fd >= 0);
+    unlink(path);
+    CHECK(HmmProfileDump(fd, format) == 0);
+    CHECK(lseek(fd, 0, SEEK_SET) == 0);
+    length = read(fd, dump, sizeof(dump) - 1);
+    CHECK(length > 0);
+    dump[length] = '\0';
+    close(fd);
+
+    return (size_t)length;
+}
+
+// Sums the live bytes of the collapsed profile, and counts the stacks that go through allocate_tracked
+static uint64_t collapsed_live_bytes(uint32_t *trackedStacks)
+{
+    uint64_t liveBytes = 0;
+    char *line = dump;
+
+    *trackedStacks = 0;
+    while (*line != '\0')
+    {
+        char *end = strchr(line, '\n');
+        char *bytes = strrchr(line, ' ');
+        char *frame = line;
+
+        CHECK(end != NULL && bytes != NULL && bytes < end);
+        liveBytes += strtoull(bytes + 1, NULL, 10);
+        while (frame < bytes)
+        {
+            uintptr_t address = (uintptr_t)strtoull(frame, &frame, 16);
+
+            if (address > (uintptr_t)allocate_tracked && address < (uintptr_t)allocate_tracked + 256)
+            {
+                (*trackedStacks)++;
+            }
+            frame++;
+        }
+        line = end + 1;
+    }
+
+    return liveBytes;
+}
+
+// Reads a profile file written by profile_dump_file into `dump`, and removes it
+static void read_profile_file(const char *directory, pid_t pid, uint32_t sequence)
+{
+    char path[256];
+    int fd = -1;
+    ssize_t length = 0;
+
+    snprintf(path, sizeof(path), "%s/run.%d.%04u.heap", directory, (int)pid, sequence);
+    fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    length = read(fd, dump, sizeof(dump) - 1);
+    CHECK(length > 0);
+    dump[length] = '\0';
+    close(fd);
+    unlink(path);
+}
+
+// Runs this program again with HMM_PROFILE set, and checks the profiles it writes on a signal and at exit
+static void check_profile_from_env(const char *program)
+{
+    char directory[] = "/tmp/hmm-profile-XXXXXX";
+    char prefix[64];
+    char signalNumber[16];
+    pid_t child = 0;
+    int status = 0;
+
+    CHECK(mkdtemp(directory) != NULL);
+    snprintf(prefix, sizeof(prefix), "%s/run", directory);
+    snprintf(signalNumber, sizeof(signalNumber), "%d", SIGUSR2);
+
+    child = fork();
+    CHECK(child >= 0);
+    if (child == 0)
+    {
+        setenv("HMM_PROFILE", "4K", 1);
+        setenv("HMM_PROFILE_FILE", prefix, 1);
+        setenv("HMM_PROFILE_SIGNAL", signalNumber, 1);
+        execl(program, program, "from-env", (char *)NULL);
+        _exit(127);
+    }
+    CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // The dump taken on the signal and the one taken at exit both hold the blocks that were still live
+    read_profile_file(directory, child, 0);
+    CHECK(strncmp(dump, "heap profile: ", 14) == 0 && strncmp(dump, EMPTY_HEADER, strlen(EMPTY_HEADER)) != 0);
+    CHECK(strstr(dump, "\nMAPPED_LIBRARIES:\n") != NULL);
+    read_profile_file(directory, child, 1);
+    CHECK(strncmp(dump, "heap profile: ", 14) == 0 && strncmp(dump, EMPTY_HEADER, strlen(EMPTY_HEADER)) != 0);
+    CHECK(rmdir(directory) == 0);
+}
+
+int main(int argc, char **argv)
+{
+    uint64_t allocatedBytes = (uint64_t)BLOCKS * BLOCK_SIZE;
+    uint64_t liveBytes = 0;
+    uint32_t trackedStacks = 0;
+    uint32_t i = 0;
+
+    // Run again by check_profile_from_env: the profiler was started before main, from the environment
+    if (argc > 1 && strcmp(argv[1], "from-env") == 0)
+    {
+        CHECK(profileSampleRate == SAMPLE_RATE);
+        for (i = 0; i < BLOCKS; i++)
+        {
+            blocks[i] = allocate_tracked(BLOCK_SIZE);
+            CHECK(blocks[i] != NULL);
+        }
+        raise(SIGUSR2);
+        return 0;
+    }
+
+    // Nothing is sampled before profiling starts
+    CHECK(profileSampleRate == 0);
+    dump_profile(HMM_PROFILE_PPROF);
+    CHECK(strncmp(dump, EMPTY_HEADER, strlen(EMPTY_HEADER)) == 0);
+
+    // Live bytes are estimated from the samples to within a few percent of what was allocated
+    HmmProfileStart(SAMPLE_RATE);
+    for (i = 0; i < BLOCKS; i++)
+    {
+        blocks[i] = allocate_tracked(BLOCK_SIZE);
+        CHECK(blocks[i] != NULL);
+    }
+    dump_profile(HMM_PROFILE_COLLAPSED);
+    liveBytes = collapsed_live_bytes(&trackedStacks);
+    CHECK(trackedStacks > 0);
+    CHECK(liveBytes > allocatedBytes * 9 / 10 && liveBytes < allocatedBytes * 11 / 10);
+
+    // Freeing half of the blocks takes their samples out of the live profile
+    for (i = 0; i < BLOCKS; i += 2)
+    {
+        free(blocks[i]);
+    }
+    dump_profile(HMM_PROFILE_COLLAPSED);
+    liveBytes = collapsed_live_bytes(&trackedStacks);
+    CHECK(liveBytes > allocatedBytes * 4 / 10 && liveBytes < allocatedBytes * 6 / 10);
+
+    // The pprof format reports the totals, one line per stack, and the memory map for symbolization
+    dump_profile(HMM_PROFILE_PPROF);
+    CHECK(strncmp(dump, "heap profile: ", 14) == 0 && strstr(dump, "] @ heap_v2/1\n") != NULL);
+    CHECK(strstr(dump, "\nMAPPED_LIBRARIES:\n") != NULL && strstr(dump, "[heap]") != NULL);
+
+    // Once stopped, allocations are no longer sampled but the profile can still be dumped
+    HmmProfileStop();
+    for (i = 0; i < BLOCKS; i += 2)
+    {
+        blocks[i] = allocate_tracked(BLOCK_SIZE);
+    }
+    dump_profile(HMM_PROFILE_COLLAPSED);
+    CHECK(collapsed_live_bytes(&trackedStacks) == liveBytes);
+
+    // A restart clears the previous profile, and a failed write is reported
+    HmmProfileStart(SAMPLE_RATE);
+    dump_profile(HMM_PROFILE_PPROF);
+    CHECK(strncmp(dump, EMPTY_HEADER, strlen(EMPTY_HEADER)) == 0);
+    CHECK(HmmProfileDump(-1, HMM_PROFILE_PPROF) == -1);
+    HmmProfileStart(0);
+    CHECK(profileSampleRate == 0);
+
+    for (i = 0; i < BLOCKS; i++)
+    {
+        free(blocks[i]);
+    }
+
+    check_profile_from_env("/proc/self/exe");
+
+    printf("test_profiler: ok\n");
+    return 0;
+}
@@ -0,0 +1,230 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include "test.h"
+#include "../heap.h"
+#include "../FreeList.h"
+#include "../Stats.h"
+#include "../Pressure.h"
+#include "../Reclaim.h"
+
+#define LARGE (64 * 1024)
+#define BLOCKS (RECLAIM_QUEUE_DEPTH + 44)
+
+extern pthread_mutex_t heapLock;
+extern uint32_t reclaimHead;
+extern uint32_t reclaimTail;
+
+static int callbackPressure = 0;
+
+static int pressure_callback(void *context)
+{
+    return *(int *)context;
+}
+
+// Sums the voluntary context switches of every thread but the main one, which is only the reclaim thread here
+static uint64_t reclaim_thread_switches(void)
+{
+    char path[64];
+    char line[128];
+    uint64_t switches = 0;
+    unsigned long long value = 0;
+    struct dirent *entry = NULL;
+    DIR *tasks = opendir("/proc/self/task");
+    FILE *status = NULL;
+
+    CHECK(tasks != NULL);
+    while ((entry = readdir(tasks)) != NULL)
+    {
+        if (entry->d_name[0] == '.' || atoi(entry->d_name) == getpid())
+        {
+            continue;
+        }
+        snprintf(path, sizeof(path), "/proc/self/task/%d/status", atoi(entry->d_name));
+        status = fopen(path, "r");
+        CHECK(status != NULL);
+        while (fgets(line, sizeof(line), status) != NULL)
+        {
+            if (sscanf(line, "voluntary_ctxt_switches: %llu", &value) == 1)
+            {
+                switches += value;
+            }
+        }
+        fclose(status);
+    }
+    closedir(tasks);
+
+    return switches;
+}
+
+// Waits up to a second for an event counter to reach a value
+static int wait_for_counter(uint8_t event, uint64_t value)
+{
+    int i = 0;
+
+    for (i = 0; i < 1000 && HmmStatsGetCounter(event) < value; i++)
+    {
+        usleep(1000);
+    }
+    return HmmStatsGetCounter(event) >= value;
+}
+
+int main(void)
+{
+    static char *blocks[BLOCKS];
+    char *small = NULL;
+    uint64_t released = 0;
+    uint64_t switches = 0;
+    pid_t child = 0;
+    int status = 0;
+    int i = 0;
+
+    small = HmmAlloc(100);
+    CHECK(HmmReclaimStart(LARGE) == 0);
+    CHECK(HmmReclaimStart(LARGE) == 0);
+    HmmStatsReset();
+
+    // Large blocks are queued and end up in the free list; small ones are freed inline
+    for (i = 0; i < 8; i++)
+    {
+        blocks[i] = HmmAlloc(LARGE + i * 4096);
+        CHECK(blocks[i] != NULL);
+        memset(blocks[i], 0x5a, LARGE);
+    }
+    for (i = 0; i < 8; i++)
+    {
+        HmmFree(blocks[i]);
+    }
+    HmmFree(small);
+    CHECK(HmmStatsGetCounter(HMM_EVENT_RECLAIM_DEFERRED) == 8);
+    HmmReclaimFlush();
+    check_heap();
+
+    // With nothing queued the thread sleeps until it is woken, and a single queued block still gets freed
+    switches = reclaim_thread_switches();
+    usleep(200 * 1000);
+    CHECK(reclaim_thread_switches() - switches <= 1);
+    blocks[0] = HmmAlloc(LARGE);
+    CHECK(blocks[0] != NULL);
+    HmmFree(blocks[0]);
+    for (i = 0; i < 1000 && __atomic_load_n(&reclaimHead, __ATOMIC_ACQUIRE) != reclaimTail; i++)
+    {
+        usleep(1000);
+    }
+    CHECK(reclaimHead == reclaimTail);
+    check_heap();
+
+    // While the thread cannot take the lock the queue fills up, and the frees that do not fit are done inline
+    for (i = 0; i < BLOCKS; i++)
+    {
+        blocks[i] = HmmAlloc(LARGE);
+        CHECK(blocks[i] != NULL);
+    }
+    HmmStatsReset();
+    pthread_mutex_lock(&heapLock);
+    for (i = 0; i < BLOCKS; i++)
+    {
+        HmmFree(blocks[i]);
+    }
+    CHECK(HmmStatsGetCounter(HMM_EVENT_RECLAIM_DEFERRED) == RECLAIM_QUEUE_DEPTH);
+    CHECK(HmmStatsGetCounter(HMM_EVENT_RECLAIM_BACKPRESSURE) == BLOCKS - RECLAIM_QUEUE_DEPTH);
+
+    // A child forked with blocks still queued frees them itself, exactly once, and can start its own thread
+    child = fork();
+    CHECK(child >= 0);
+    if (child == 0)
+    {
+        CHECK(!reclaimActive);
+        check_heap();
+        CHECK(HmmReclaimStart(LARGE) == 0);
+        blocks[0] = HmmAlloc(LARGE);
+        HmmFree(blocks[0]);
+        HmmReclaimFlush();
+        check_heap();
+        HmmReclaimStop();
+        _exit(0);
+    }
+    CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    pthread_mutex_unlock(&heapLock);
+
+    // Flushing waits for the queue to drain and trims the heap
+    HmmReclaimFlush();
+    check_heap();
+    CHECK(programBreak - heapStart < 1024 * 1024);
+
+    // Forks racing with the thread always leave the child a consistent heap
+    for (i = 0; i < 200; i++)
+    {
+        blocks[i % 16] = HmmAlloc(LARGE + (i % 5) * 8192);
+        if (i % 16 == 15)
+        {
+            int j = 0;
+
+            for (j = 0; j < 16; j++)
+            {
+                HmmFree(blocks[j]);
+            }
+            child = fork();
+            CHECK(child >= 0);
+            if (child == 0)
+            {
+                check_heap();
+                _exit(0);
+            }
+            CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        }
+    }
+    for (i = 200 - 200 % 16; i < 200; i++)
+    {
+        HmmFree(blocks[i % 16]);
+    }
+    HmmReclaimFlush();
+    check_heap();
+
+    // Interior free pages are released once when pressure starts, not again on every check while it lasts
+    for (i = 0; i < 16; i++)
+    {
+        blocks[i] = HmmAlloc(LARGE);
+        memset(blocks[i], 1, LARGE);
+    }
+    for (i = 0; i < 16; i += 2)
+    {
+        HmmFree(blocks[i]);
+    }
+    HmmReclaimFlush();
+    HmmStatsReset();
+    HmmPressureWatchCallback(pressure_callback, &callbackPressure);
+    callbackPressure = 1;
+    CHECK(HmmPressureCheck() == 1);
+    CHECK(wait_for_counter(HMM_EVENT_PAGES_RELEASED, 8));
+    usleep(50 * 1000);
+    released = HmmStatsGetCounter(HMM_EVENT_PAGES_RELEASED);
+    for (i = 0; i < 5; i++)
+    {
+        CHECK(HmmPressureCheck() == 1);
+        usleep(20 * 1000);
+    }
+    CHECK(HmmStatsGetCounter(HMM_EVENT_PAGES_RELEASED) == released);
+    for (i = 0; i < 16; i += 2)
+    {
+        blocks[i] = HmmCalloc(1, LARGE);
+        CHECK(blocks[i] != NULL && blocks[i][LARGE / 2] == 0);
+    }
+    check_heap();
+    HmmPressureStop();
+
+    for (i = 0; i < 16; i++)
+    {
+        HmmFree(blocks[i]);
+    }
+    HmmReclaimStop();
+    CHECK(!reclaimActive);
+    check_heap();
+
+    printf("test_reclaim: ok\n");
+    return 0;
+}
@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include "test.h"
+#include "../SharedHeap.h"
+
+#define CAPACITY (1 << 20)
+#define MESSAGES 20000
+
+static char name[64];
+
+/*
+ * Walks the blocks and the free list of a shared heap and checks that they agree: the blocks tile the segment,
+ * the list is address-ordered and links back, and it holds exactly the free blocks. Returns the free bytes.
+ */
+static uint64_t check_shared(HmmSharedHeap *heap)
+{
+    uint64_t offset = SHARED_HEAP_HEADER_SIZE;
+    uint64_t listOffset = heap->freeListHead;
+    uint64_t previous = 0;
+    uint64_t freeBytes = 0;
+
+    while (offset < heap->capacity)
+    {
+        SharedFreeNode *node = (SharedFreeNode *)((char *)heap + offset);
+
+        CHECK(node->length >= 8 && (node->length & 7) == 0);
+        if (node->prev != SHARED_BLOCK_IN_USE)
+        {
+            CHECK(offset == listOffset && node->prev == previous);
+            freeBytes += node->length;
+            previous = offset;
+            listOffset = node->next;
+        }
+        offset += sizeof(SharedFreeNode) + node->length;
+    }
+    CHECK(offset == heap->capacity && listOffset == 0);
+
+    return freeBytes;
+}
+
+// Takes the heap lock in a child, lets `damage` run, and dies without unlocking
+static void die_holding_lock(HmmSharedHeap *heap, void (*damage)(HmmSharedHeap *heap))
+{
+    pid_t child = fork();
+    int status = 0;
+
+    CHECK(child >= 0);
+    if (child == 0)
+    {
+        pthread_mutex_lock(&heap->lock);
+        damage(heap);
+        _exit(0);
+    }
+    CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status));
+}
+
+// Leaves the list as a split that stopped half-way: the block shrunk, the remainder never linked in
+static void half_split(HmmSharedHeap *heap)
+{
+    SharedFreeNode *node = (SharedFreeNode *)((char *)heap + heap->freeListHead);
+    SharedFreeNode *remainder = (SharedFreeNode *)((char *)node + sizeof(SharedFreeNode) + 64);
+
+    remainder->length = node->length - 64 - sizeof(SharedFreeNode);
+    remainder->prev = 12345;
+    remainder->next = 999999999;
+    node->length = 64;
+    heap->freeListHead = 8;
+}
+
+// Damages a block length, which the free list cannot be rebuilt without
+static void bad_length(HmmSharedHeap *heap)
+{
+    ((SharedFreeNode *)((char *)heap + SHARED_HEAP_HEADER_SIZE))->length = 13;
+}
+
+int main(void)
+{
+    HmmSharedHeap *heap = NULL;
+    uint64_t emptyBytes = 0;
+    uint64_t offset = 0;
+    int channel[2];
+    pid_t consumer = 0;
+    int status = 0;
+    uint32_t i = 0;
+    void *blocks[16];
+
+    snprintf(name, sizeof(name), "/hmm-test-%d", (int)getpid());
+    heap = HmmSharedOpen(name, CAPACITY, 1);
+    CHECK(heap != NULL);
+    CHECK(HmmSharedOpen(name, CAPACITY, 1) == NULL);
+    emptyBytes = check_shared(heap);
+    CHECK(emptyBytes == CAPACITY - SHARED_HEAP_HEADER_SIZE - sizeof(SharedFreeNode));
+
+    // Sizes close to the limit are rejected instead of wrapping around when rounded
+    CHECK(HmmSharedAlloc(heap, SIZE_MAX) == NULL);
+    CHECK(HmmSharedAlloc(heap, SIZE_MAX - 3) == NULL);
+    CHECK(HmmSharedAlloc(heap, CAPACITY) == NULL);
+    CHECK(check_shared(heap) == emptyBytes);
+
+    // A forked consumer maps the heap on its own, checks every message and frees it while more are produced
+    CHECK(pipe(channel) == 0);
+    consumer = fork();
+    CHECK(consumer >= 0);
+    if (consumer == 0)
+    {
+        HmmSharedHeap *consumerHeap = HmmSharedOpen(name, 0, 0);
+        uint32_t expected = 0;
+
+        close(channel[1]);
+        if (consumerHeap == NULL)
+        {
+            _exit(2);
+        }
+        while (read(channel[0], &offset, sizeof(offset)) == sizeof(offset))
+        {
+            uint32_t *message = HmmSharedPointer(consumerHeap, offset);
+
+            if (message == NULL || message[0] != expected || message[message[1] - 1] != expected ||
+                HmmSharedFree(consumerHeap, message) != 0)
+            {
+                _exit(3);
+            }
+            expected++;
+        }
+        HmmSharedClose(consumerHeap);
+        _exit(expected == MESSAGES ? 0 : 4);
+    }
+    close(channel[0]);
+    for (i = 0; i < MESSAGES; i++)
+    {
+        uint32_t words = 3 + (i * 7919) % 1024;
+        uint32_t *message = NULL;
+
+        while ((message = HmmSharedAlloc(heap, words * sizeof(uint32_t))) == NULL)
+        {
+            CHECK(waitpid(consumer, &status, WNOHANG) == 0);
+            sched_yield();
+        }
+        message[0] = i;
+        message[1] = words;
+        message[words - 1] = i;
+        offset = HmmSharedOffset(heap, message);
+        CHECK(write(channel[1], &offset, sizeof(offset)) == sizeof(offset));
+    }
+    close(channel[1]);
+    CHECK(waitpid(consumer, &status, 0) == consumer && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    CHECK(check_shared(heap) == emptyBytes);
+
+    // A process that dies in the middle of an update leaves a list that the next locker rebuilds
+    for (i = 0; i < 16; i++)
+    {
+        blocks[i] = HmmSharedAlloc(heap, 100 + i * 8);
+        CHECK(blocks[i] != NULL);
+    }
+    for (i = 0; i < 16; i += 2)
+    {
+        CHECK(HmmSharedFree(heap, blocks[i]) == 0);
+    }
+    die_holding_lock(heap, half_split);
+    blocks[0] = HmmSharedAlloc(heap, 200);
+    CHECK(blocks[0] != NULL);
+    check_shared(heap);
+    CHECK(HmmSharedFree(heap, blocks[0]) == 0);
+    for (i = 1; i < 16; i += 2)
+    {
+        CHECK(HmmSharedFree(heap, blocks[i]) == 0);
+    }
+    CHECK(check_shared(heap) == emptyBytes);
+
+    // Damaged blocks cannot be rebuilt from, and the heap becomes unusable for everyone
+    die_holding_lock(heap, bad_length);
+    errno = 0;
+    CHECK(HmmSharedAlloc(heap, 64) == NULL && errno == ENOTRECOVERABLE);
+    errno = 0;
+    CHECK(HmmSharedAlloc(heap, 64) == NULL && errno == ENOTRECOVERABLE);
+    errno = 0;
+    CHECK(HmmSharedFree(heap, (char *)heap + SHARED_HEAP_HEADER_SIZE + sizeof(SharedFreeNode)) == -1 &&
+          errno == ENOTRECOVERABLE);
+
+    HmmSharedClose(heap);
+    CHECK(HmmSharedUnlink(name) == 0);
+    printf("test_shared: ok\n");
+    return 0;
+}
@@ -0,0 +1,96 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "test.h"
+#include "../heap.h"
+#include "../Stats.h"
+
+#define OPERATIONS 1000
+
+static void *blocks[OPERATIONS];
+
+// Checks that the buckets of a histogram add up to its count
+static void check_histogram(uint8_t op, uint64_t count)
+{
+    HmmLatencyHistogram histogram;
+    uint64_t bucketTotal = 0;
+    uint32_t i = 0;
+
+    CHECK(HmmStatsGetHistogram(op, &histogram) == 0);
+    CHECK(histogram.count == count);
+    for (i = 0; i < HMM_HISTOGRAM_BUCKETS; i++)
+    {
+        bucketTotal += histogram.buckets[i];
+    }
+    CHECK(bucketTotal == count);
+    CHECK(count == 0 || (histogram.maxCycles > 0 && histogram.totalCycles >= histogram.maxCycles));
+}
+
+int main(void)
+{
+    HmmLatencyHistogram histogram;
+    uint32_t i = 0;
+
+    // Every operation lands in exactly one bucket of its histogram
+    HmmStatsReset();
+    for (i = 0; i < OPERATIONS; i++)
+    {
+        blocks[i] = HmmAlloc(64);
+        CHECK(blocks[i] != NULL);
+    }
+    check_histogram(HMM_OP_ALLOC, OPERATIONS);
+    check_histogram(HMM_OP_REALLOC, 0);
+
+    // Growing moves the block and shrinking keeps it; both are counted as realloc events
+    for (i = 0; i < OPERATIONS; i++)
+    {
+        blocks[i] = HmmRealloc(blocks[i], (i % 2) ? 256 : 16);
+        CHECK(blocks[i] != NULL);
+    }
+    check_histogram(HMM_OP_REALLOC, OPERATIONS);
+    CHECK(HmmStatsGetCounter(HMM_EVENT_REALLOC_COPY) == OPERATIONS / 2);
+    CHECK(HmmStatsGetCounter(HMM_EVENT_REALLOC_IN_PLACE) == OPERATIONS / 2);
+    CHECK(HmmStatsGetCounter(HMM_EVENT_BREAK_INCREASE) > 0);
+
+    HmmStatsReset();
+    for (i = 0; i < OPERATIONS; i++)
+    {
+        HmmFree(blocks[i]);
+    }
+    check_histogram(HMM_OP_FREE, OPERATIONS);
+    check_histogram(HMM_OP_ALLOC, 0);
+
+    // A percentile is the upper bound of the bucket that holds it
+    HmmStatsReset();
+    CHECK(HmmStatsPercentile(HMM_OP_REALLOC, 50.0) == 0);
+    for (i = 0; i < 99; i++)
+    {
+        stats_record_latency(HMM_OP_REALLOC, 1000);
+    }
+    stats_record_latency(HMM_OP_REALLOC, 1000000);
+    CHECK(HmmStatsGetHistogram(HMM_OP_REALLOC, &histogram) == 0);
+    CHECK(histogram.buckets[9] == 99 && histogram.buckets[19] == 1);
+    CHECK(histogram.maxCycles == 1000000 && histogram.totalCycles == 99 * 1000 + 1000000);
+    CHECK(HmmStatsPercentile(HMM_OP_REALLOC, 0.0) == 1024);
+    CHECK(HmmStatsPercentile(HMM_OP_REALLOC, 50.0) == 1024);
+    CHECK(HmmStatsPercentile(HMM_OP_REALLOC, 99.0) == 1024);
+    CHECK(HmmStatsPercentile(HMM_OP_REALLOC, 99.9) == 1 << 20);
+    CHECK(HmmStatsPercentile(HMM_OP_REALLOC, 100.0) == 1 << 20);
+
+    // The top bucket has no upper bound, so the maximum is reported instead
+    stats_record_latency(HMM_OP_REALLOC, UINT64_MAX - 1);
+    CHECK(HmmStatsPercentile(HMM_OP_REALLOC, 100.0) == UINT64_MAX - 1);
+
+    // Out-of-range identifiers are rejected
+    CHECK(HmmStatsGetHistogram(HMM_OP_COUNT, &histogram) == -1);
+    CHECK(HmmStatsGetHistogram(HMM_OP_ALLOC, NULL) == -1);
+    CHECK(HmmStatsPercentile(HMM_OP_COUNT, 50.0) == 0);
+    CHECK(HmmStatsGetCounter(HMM_EVENT_COUNT) == 0);
+
+    HmmStatsReset();
+    check_histogram(HMM_OP_REALLOC, 0);
+    CHECK(HmmStatsGetCounter(HMM_EVENT_REALLOC_COPY) == 0);
+
+    printf("test_stats: ok\n");
+    return 0;
+}
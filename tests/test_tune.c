@@ -0,0 +1,94 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "test.h"
+#include "../heap.h"
+#include "../Tune.h"
+
+static void check_round_trip(void)
+{
+    char text[TUNE_TEXT_MAX];
+    HmmTuneConfig before;
+    HmmTuneConfig after;
+
+    HmmTuneGet(&before);
+    CHECK(HmmTuneExport(text, sizeof(text)) < TUNE_TEXT_MAX);
+    CHECK(HmmTuneImport(text) == 0);
+    HmmTuneGet(&after);
+    CHECK(memcmp(&before, &after, sizeof(before)) == 0);
+}
+
+int main(void)
+{
+    char text[TUNE_TEXT_MAX];
+    HmmTuneConfig config;
+    HmmTuneConfig pinned;
+    void *blocks[1024];
+    int i = 0;
+
+    // The defaults export to text that imports back unchanged
+    check_round_trip();
+    HmmTuneExport(text, sizeof(text));
+    CHECK(strcmp(text, "min=24,round=8,growth=204800,trim=131072") == 0);
+
+    // A valid configuration is pinned as given, and parameters left out keep their value
+    CHECK(HmmTuneImport("min=16,round=16,growth=1048576") == 0);
+    HmmTuneGet(&config);
+    CHECK(config.minBlockSize == 16 && config.roundingSize == 16);
+    CHECK(config.growthSize == 1048576 && config.trimSize == 131072);
+    check_round_trip();
+
+    // Invalid configurations are rejected, not rounded, and leave the configuration in use alone
+    HmmTuneGet(&pinned);
+    CHECK(HmmTuneImport("growth=65544,trim=65544") == -1);
+    CHECK(HmmTuneImport("growth=65544") == -1);
+    CHECK(HmmTuneImport("trim=70000") == -1);
+    CHECK(HmmTuneImport("growth=32768") == -1);
+    CHECK(HmmTuneImport("min=20") == -1);
+    CHECK(HmmTuneImport("min=8") == -1);
+    CHECK(HmmTuneImport("round=12") == -1);
+    CHECK(HmmTuneImport("round=4") == -1);
+    CHECK(HmmTuneImport("round=8192") == -1);
+    CHECK(HmmTuneImport("min=24,size=8") == -1);
+    CHECK(HmmTuneImport("min=") == -1);
+    CHECK(HmmTuneImport("min=24x") == -1);
+    CHECK(HmmTuneSet(NULL) == -1);
+    HmmTuneGet(&config);
+    CHECK(memcmp(&config, &pinned, sizeof(config)) == 0);
+
+    // Page-sized steps are the smallest unit accepted
+    config.growthSize = TUNE_MIN_STEP + (uint64_t)sysconf(_SC_PAGESIZE);
+    config.trimSize = TUNE_MIN_STEP;
+    CHECK(HmmTuneSet(&config) == 0);
+    check_round_trip();
+
+    // The allocator keeps working with a pinned configuration
+    for (i = 0; i < 1024; i++)
+    {
+        blocks[i] = HmmAlloc(1 + i * 37);
+        CHECK(blocks[i] != NULL && ((uintptr_t)blocks[i] & 7) == 0);
+        memset(blocks[i], 0xab, 1 + i * 37);
+    }
+    for (i = 0; i < 1024; i++)
+    {
+        HmmFree(blocks[i]);
+    }
+
+    // Adapting to mostly tiny requests drops the minimum block size, and the result still round-trips
+    CHECK(HmmTuneImport("min=24,round=8,growth=204800,trim=131072") == 0);
+    HmmTuneStart();
+    for (i = 0; i < 70000; i++)
+    {
+        blocks[i % 1024] = HmmAlloc(8);
+        CHECK(blocks[i % 1024] != NULL);
+        HmmFree(blocks[i % 1024]);
+    }
+    HmmTuneStop();
+    HmmTuneGet(&config);
+    CHECK(config.minBlockSize == 16);
+    check_round_trip();
+
+    printf("test_tune: ok\n");
+    return 0;
+}